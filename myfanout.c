@@ -0,0 +1,175 @@
+/*
+ * myfanout.c - Stress the tiny shell's reaping and job control
+ *
+ * usage: myfanout [-w <width>] [-d <depth>] [-l <min>[-<max>]] [-e <mean>]
+ *                 [-b] [-s <pct>] [-i <pct>] [-r <seed>]
+ * Build a tree of processes: each process down to depth <depth>
+ * (default 2) forks <width> children (default 4). Every process lives
+ * for a lifetime in microseconds, drawn uniformly from <min>-<max>
+ * (default 1000-10000) or, with -e, exponentially around <mean>,
+ * sleeping or, with -b, burning CPU. Then each process other than the
+ * root stops the whole process group with SIGTSTP with probability
+ * <pct>% (-s), as mystop does, or interrupts it with SIGINT with
+ * probability <pct>% (-i), and waits for its own children. -r seeds
+ * the random choices, so a tree can be built again the same way.
+ *
+ * When the tree is done the root prints one line for the benchmark
+ * harness to check:
+ *     myfanout (<pid>): procs=<n> stops=<n> elapsed=<us> us
+ * procs counts every process in the tree, the root included, and
+ * stops the SIGTSTPs sent. A tree interrupted by SIGINT prints nothing;
+ * the shell reports it terminated.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <signal.h>
+
+struct counts {                 /* shared by the whole tree */
+    long procs;
+    long stops;
+};
+
+int width = 4, depth = 2, burn;
+long minus = 1000, maxus = 10000, meanus;
+int stoppct, intpct;
+unsigned seed;
+struct counts *counts;
+
+/* now_us - Monotonic time in microseconds */
+long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* lifetime - Draw a lifetime in microseconds */
+long lifetime(unsigned *rs)
+{
+    double u = (rand_r(rs) + 1.0) / (RAND_MAX + 2.0);
+
+    if (meanus > 0)
+	return -log(u) * meanus;
+    return minus + u * (maxus - minus);
+}
+
+/* live - Sleep or spin for us microseconds */
+void live(long us)
+{
+    struct timespec ts;
+    long end;
+
+    if (burn) {
+	end = now_us() + us;
+	while (now_us() < end)
+	    ;
+	return;
+    }
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = us % 1000000 * 1000;
+    while (nanosleep(&ts, &ts) < 0)
+	;
+}
+
+/* node - Run the process numbered id at level level of the tree */
+void node(long id, int level)
+{
+    unsigned rs = seed ^ (unsigned)(id * 2654435761u);
+    int i;
+    pid_t pid;
+
+    __sync_fetch_and_add(&counts->procs, 1);
+    if (level < depth) {
+	for (i = 0; i < width; i++) {
+	    if ((pid = fork()) < 0) {
+		perror("fork");
+		exit(1);
+	    }
+	    if (pid == 0) {
+		node(id * width + i + 1, level + 1);
+		exit(0);
+	    }
+	}
+    }
+
+    live(lifetime(&rs));
+    if (level > 0) {
+	if (rand_r(&rs) % 100 < stoppct) {
+	    __sync_fetch_and_add(&counts->stops, 1);
+	    if (kill(-getpgrp(), SIGTSTP) < 0)
+		fprintf(stderr, "kill (tstp) error");
+	}
+	if (rand_r(&rs) % 100 < intpct) {
+	    if (kill(-getpgrp(), SIGINT) < 0)
+		fprintf(stderr, "kill (int) error");
+	}
+    }
+
+    while (wait(NULL) > 0)
+	;
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    long t0;
+
+    seed = getpid();
+    while ((c = getopt(argc, argv, "w:d:l:e:bs:i:r:")) != EOF) {
+	switch (c) {
+	case 'w':
+	    width = atoi(optarg);
+	    break;
+	case 'd':
+	    depth = atoi(optarg);
+	    break;
+	case 'l':
+	    if (sscanf(optarg, "%ld-%ld", &minus, &maxus) == 1)
+		maxus = minus;
+	    break;
+	case 'e':
+	    meanus = atol(optarg);
+	    break;
+	case 'b':
+	    burn = 1;
+	    break;
+	case 's':
+	    stoppct = atoi(optarg);
+	    break;
+	case 'i':
+	    intpct = atoi(optarg);
+	    break;
+	case 'r':
+	    seed = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "Usage: %s [-w <width>] [-d <depth>] [-l <min>[-<max>]] "
+		    "[-e <mean>] [-b] [-s <pct>] [-i <pct>] [-r <seed>]\n", argv[0]);
+	    exit(0);
+	}
+    }
+    if (width < 0 || depth < 0 || minus < 0 || maxus < minus) {
+	fprintf(stderr, "%s: bad tree or lifetime\n", argv[0]);
+	exit(1);
+    }
+
+    counts = mmap(NULL, sizeof(struct counts), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counts == MAP_FAILED) {
+	perror("mmap");
+	exit(1);
+    }
+
+    t0 = now_us();
+    node(0, 0);
+    printf("myfanout (%d): procs=%ld stops=%ld elapsed=%ld us\n", getpid(),
+	   counts->procs, counts->stops, now_us() - t0);
+    exit(0);
+}
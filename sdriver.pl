@@ -3,6 +3,9 @@
 use Getopt::Std;
 use FileHandle;
 use IPC::Open2;
+use IO::Select;
+use POSIX ":sys_wait_h";
+use Time::HiRes qw(time sleep);
 
 #######################################################################
 # sdriver.pl - Shell driver
@@ -32,7 +35,23 @@ use IPC::Open2;
 #     KILL        Send a SIGKILL signal to the child
 #     CLOSE       Close Writer (sends EOF signal to child)
 #     WAIT        Wait() for child to terminate
-#     SLEEP <n>   Sleep for <n> seconds
+#     SLEEP <n>   Sleep for <n> seconds, which may have a fraction,
+#                 or for <n> milliseconds if followed by ms
+#
+# Replay mode (-r):
+#
+# Normally every command is written to the shell as soon as it is
+# read from the trace, and the output is only read at the end. With
+# -r the driver replays the trace the way a person would type it: the
+# shell is run with its prompt (any -p is dropped), and each command
+# is sent only once the prompt for it has appeared. Every command
+# sent, signal sent and line of output is printed with the time since
+# the start in ms. So is how long each command took to bring back
+# the prompt, and how long each TSTP or INT took to bring the
+# "stopped by signal" or "terminated by signal" message. Percentiles
+# of both follow. Further trace files after the options are replayed
+# at the same time, each against a shell of its own, and reported in
+# order.
 # 
 ######################################################################
 
@@ -42,7 +61,7 @@ use IPC::Open2;
 sub usage 
 {
     printf STDERR "$_[0]\n";
-    printf STDERR "Usage: $0 [-hv] -t <trace> -s <shellprog> -a <args>\n";
+    printf STDERR "Usage: $0 [-hvr] -t <trace> -s <shellprog> -a <args> [<trace> ...]\n";
     printf STDERR "Options:\n";
     printf STDERR "  -h            Print this message\n";
     printf STDERR "  -v            Be more verbose\n";
@@ -50,11 +69,12 @@ sub usage
     printf STDERR "  -s <shell>    Shell program to test\n";
     printf STDERR "  -a <args>     Shell arguments\n";
     printf STDERR "  -g            Generate output for autograder\n";
+    printf STDERR "  -r            Replay with timings, and run further traces concurrently\n";
     die "\n" ;
 }
 
 # Parse the command line arguments
-getopts('hgvt:s:a:');
+getopts('hgvrt:s:a:');
 if ($opt_h) {
     usage();
 }
@@ -69,6 +89,10 @@ $infile = $opt_t;
 $shellprog = $opt_s;
 $shellargs = $opt_a;
 $grade = $opt_g;
+$replay = $opt_r;
+if (@ARGV && !$replay) {
+    usage("Only -r takes more than one trace");
+}
 
 # Make sure the input script exists and is readable
 -e $infile
@@ -82,6 +106,13 @@ $grade = $opt_g;
 -x $shellprog
     or die "$0: ERROR: $shellprog is not executable\n";
 
+if ($replay) {
+    # The shell shows its prompt here, but the trace isn't the user's history
+    $ENV{TSH_HISTORY} = "";
+    replayall($infile, @ARGV);
+    exit;
+}
+
 
 # Open the input script
 open INFILE, $infile
@@ -172,11 +203,11 @@ while (<INFILE>) {
     }
 
     # Sleep
-    elsif ($line =~ /SLEEP (\d+)/) {
+    elsif ($line =~ /SLEEP (\d*\.?\d+)(ms)?/) {
 	if ($verbose) {
-	    print "$0: Sleeping $1 secs\n";
+	    print "$0: Sleeping $1 ", $2 ? "msecs" : "secs", "\n";
 	}
-	sleep $1;
+	sleep($2 ? $1 / 1000 : $1);
     }
 
     # Unknown input
@@ -208,3 +239,154 @@ if ($verbose) {
 }
 
 exit;
+
+#
+# percentiles - Summary of a list of latencies in ms
+#
+sub percentiles
+{
+    my @v = sort { $a <=> $b } @_;
+    my $n = @v;
+
+    return "none" if $n == 0;
+    return sprintf("n=%d min=%.3f p50=%.3f p90=%.3f p99=%.3f max=%.3f ms",
+		   $n, $v[0], $v[int($n / 2)], $v[int($n * 9 / 10)],
+		   $v[int($n * 99 / 100)], $v[$n - 1]);
+}
+
+#
+# replaytrace - Replay one trace against a shell of its own, as
+#     described at the top, and return the report as a string
+#
+sub replaytrace
+{
+    my ($trace) = @_;
+    my ($rd, $wr, $line, $buf, $out, $t0, $pid, $sel);
+    my ($sent, $prompts, $eof, $cmdtime, @cmdlat, @siglat, @pending);
+    my $args = join(" ", grep { $_ ne "-p" } split(" ", $shellargs));
+
+    open my $in, "<", $trace
+	or die "$0: ERROR: Couldn't open input file $trace: $!\n";
+    $pid = open2($rd, $wr, "$shellprog $args");
+    $wr->autoflush();
+    $sel = IO::Select->new($rd);
+    $t0 = time;
+    $buf = $out = "";
+    $sent = $prompts = $eof = 0;
+
+    my $ms = sub { return (time - $t0) * 1000; };
+
+    # Read output until $cond holds, $until (a time) passes, or EOF
+    my $pump = sub {
+	my ($cond, $until) = @_;
+	my ($data, $wait, $l);
+
+	while (!$eof && !($cond && $cond->())) {
+	    $wait = defined $until ? $until - time : undef;
+	    last if defined $wait && $wait <= 0;
+	    next unless $sel->can_read($wait);
+	    if (!sysread($rd, $data, 65536)) {
+		$eof = 1;
+		last;
+	    }
+	    $buf .= $data;
+	    while (1) {
+		if ($buf =~ s/^([^\n]*)\n//) {
+		    $l = $1;
+		    $out .= sprintf("%10.3f < %s\n", $ms->(), $l);
+		    if (@pending && $l =~ /(stopped|terminated) by signal/) {
+			my ($sig, $t) = @{shift @pending};
+			my $now = $ms->();
+			push @siglat, $now - $t;
+			$out .= sprintf("%10.3f   %s took %.3f ms\n", $now, $sig, $now - $t);
+		    }
+		}
+		# The shell prints its prompt alone and then waits
+		elsif ($buf eq "tsh> ") {
+		    $buf = "";
+		    $prompts++;
+		    if (defined $cmdtime && $prompts > $sent) {
+			my $now = $ms->();
+			push @cmdlat, $now - $cmdtime;
+			$out .= sprintf("%10.3f   prompt after %.3f ms\n", $now, $now - $cmdtime);
+			undef $cmdtime;
+		    }
+		}
+		else {
+		    last;
+		}
+	    }
+	}
+    };
+
+    while (<$in>) {
+	$line = $_;
+	chomp($line);
+	if ($line =~ /^#/) {
+	    $out .= "$line\n";
+	}
+	elsif ($line =~ /^\s*$/) {
+	}
+	elsif ($line =~ /(TSTP|INT|QUIT|KILL)/) {
+	    $out .= sprintf("%10.3f ! SIG%s\n", $ms->(), $1);
+	    push @pending, [$1, $ms->()] if $1 eq "TSTP" || $1 eq "INT";
+	    kill $1, $pid;
+	}
+	elsif ($line =~ /CLOSE/) {
+	    $out .= sprintf("%10.3f ! CLOSE\n", $ms->());
+	    close $wr;
+	}
+	elsif ($line =~ /WAIT/) {
+	    $pump->();
+	    waitpid($pid, 0);
+	    $out .= sprintf("%10.3f ! shell exited\n", $ms->());
+	}
+	elsif ($line =~ /SLEEP (\d*\.?\d+)(ms)?/) {
+	    $pump->(undef, time + ($2 ? $1 / 1000 : $1));
+	}
+	else {
+	    $pump->(sub { $prompts > $sent });
+	    last if $eof;
+	    $sent++;
+	    $cmdtime = $ms->();
+	    $out .= sprintf("%10.3f > %s\n", $cmdtime, $line);
+	    print $wr "$line\n";
+	}
+    }
+    close $wr;
+    $pump->();
+    waitpid($pid, 0);
+    $out .= sprintf("%10.3f   %s\n", $ms->(), $buf) if $buf ne "" && $buf ne "tsh> ";
+    $out .= "# $trace: commands " . percentiles(@cmdlat) . "\n";
+    $out .= "# $trace: signals " . percentiles(@siglat) . "\n";
+    return $out;
+}
+
+#
+# replayall - Replay each trace against its own shell, all at once,
+#     and print their reports in order
+#
+sub replayall
+{
+    my @traces = @_;
+    my ($t0, @readers, $kid);
+
+    $t0 = time;
+    foreach my $trace (@traces) {
+	$kid = open(my $fh, "-|");
+	defined $kid
+	    or die "$0: ERROR: fork: $!\n";
+	if ($kid == 0) {
+	    print replaytrace($trace);
+	    exit;
+	}
+	push @readers, $fh;
+    }
+    foreach my $fh (@readers) {
+	print while <$fh>;
+	close $fh;
+    }
+    if (@traces > 1) {
+	printf("# %d traces replayed concurrently in %.3f s\n", scalar @traces, time - $t0);
+    }
+}
@@ -4,6 +4,7 @@
      * Name:Rishikesh Bhatt
      * Email-id:201501062@daiict.ac.in
      */
+    #define _GNU_SOURCE             /* splice, memfd_create, pipe2 */
     #include <stdio.h>
     #include <stdlib.h>
     #include <unistd.h>
@@ -12,13 +13,33 @@
     #include <signal.h>
     #include <sys/types.h>
     #include <sys/wait.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <sys/sendfile.h>
+    #include <sys/time.h>
+    #include <sys/resource.h>
+    #include <sys/epoll.h>
+    #include <sys/timerfd.h>
+    #include <sys/syscall.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <time.h>
     #include <errno.h>
+    #include <limits.h>
+    #include <fcntl.h>
+    #include <spawn.h>
+    #include <sched.h>
+    #include <dirent.h>
 
     /* Misc manifest constants */
-    #define MAXLINE    1024   /* max line size */
-    #define MAXARGS     128   /* max args on a command line */
-    #define MAXJOBS      16   /* max jobs at any point in time */
-    #define MAXJID    1<<16   /* max job ID */
+    #define MAXLINE    1024   /* line buffer size to start with */
+    #define MAXARGS     128   /* argv slots to start with */
+    #define MAXSTAGES    64   /* max commands in a pipeline */
+    #define MAXJOBS (1<<20)   /* max jobs at any point in time */
+    #define MAXJID  (1<<21)   /* max job ID, past which free ones are reused */
+    #define HASHSIZE     64   /* buckets in the command path cache */
+    #define MAXREDIRS     8   /* max redirections per command */
+    #define TRACESIZE (1<<16) /* events kept by the trace ring */
 
     /* Job states */
     #define UNDEF 0 /* undefined */
@@ -26,6 +47,10 @@
     #define BG 2    /* running in background */
     #define ST 3    /* stopped */
 
+    /* Trace event types, see traceevent */
+    enum { EV_PARSE, EV_BUILTIN, EV_SPAWN, EV_FORK, EV_SETPGID, EV_WAIT,
+           EV_STOP, EV_CONT, EV_REAP, EV_SIGNAL, EV_JOBSTART, EV_JOBEND };
+
     /* 
      * Jobs states: FG (foreground), BG (background), ST (stopped)
      * Job state transitions and enabling actions:
@@ -40,16 +65,241 @@
     extern char **environ;      /* defined in libc */
     char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
     int verbose = 0;            /* if true, print additional output */
-    int nextjid = 1;            /* next job ID to allocate */
+    int usefork = 0;            /* if true, launch jobs with fork+execve */
     char sbuf[MAXLINE];         /* for composing sprintf messages */
+    int builtin_in = STDIN_FILENO;  /* stdin of the running builtin */
+    int laststatus;                 /* exit status of the last builtin or foreground job */
+    int nwaited;                    /* jobs marked waited that have finished or stopped */
+    int waitedstatus;               /* wait status of the last of them */
+    volatile sig_atomic_t kbdsig;   /* SIGINT or SIGTSTP once typed */
+    int wakefd[2];                  /* self-pipe the signal handlers write */
+    volatile sig_atomic_t gotchld, gotint, gottstp; /* signals to act on */
+    int epfd;                       /* epoll set the main flow sleeps in */
+
+    /*
+     * What an epoll event is for: the self-pipe, stdin, the deadline
+     * timer, the job server's socket or one of its clients, or else a
+     * child's PID
+     */
+    #define EP_WAKE   (1ULL << 32)
+    #define EP_INPUT  (2ULL << 32)
+    #define EP_TIMER  (3ULL << 32)
+    #define EP_LISTEN (4ULL << 32)
+    #define EP_CLIENT (5ULL << 32)  /* plus the client's slot */
+
+    struct client_t {           /* A connection to the job server */
+            int fd;                 /* -1 once closed, and the slot free */
+            int ready;              /* epoll has reported it */
+            int eof;                /* it has sent all it will */
+            char *in;               /* what it has sent, not yet run */
+            size_t inlen, incap;
+            char *out;              /* replies not yet written */
+            size_t outoff, outlen, outcap;
+    };
+    struct client_t *clients;       /* indexed by slot */
+    size_t nclients, clientcap;
+    int listenfd = -1;              /* -S: the job server's socket */
+    int listenready;                /* a connection is waiting on it */
+    char *sockpath;                 /* where it is bound, removed at exit */
+    FILE *stdout0;                  /* the real stdout while a reply is collected */
+
+    struct reader_t {           /* Buffered line reader on a descriptor */
+            int fd;
+            int start, end;         /* the bytes not yet returned */
+            int eof;                /* read has returned 0 */
+            char buf[1<<16];
+    };
+    struct reader_t input = {STDIN_FILENO}; /* the shell's stdin */
+
+    struct redir_t {            /* One I/O redirection */
+            int fd;                 /* descriptor being redirected */
+            int src;                /* descriptor to dup onto it */
+            int append;             /* >> rather than > */
+            char *file;             /* file to open, NULL for 2>&1 */
+    };
+
+    struct stage_t {            /* One command of a pipeline */
+            char **argv;            /* its arguments, NULL-terminated */
+            int nredirs;            /* redirections, applied in order */
+            struct redir_t redirs[MAXREDIRS];
+    };
+
+    /*
+     * A parsed command line. Its buffers grow to fit the longest line
+     * seen so far and are kept for the next one, so once they have
+     * grown a line is parsed without allocating anything.
+     */
+    struct globword_t {         /* A word that is a pattern, see globwords */
+            size_t arg;             /* its place in argv */
+            size_t start, end;      /* where it was typed in the line */
+            int quoted;             /* has quotes or escapes in it */
+            size_t first, count;    /* the names it matched */
+    };
 
-    struct job_t {              /* The job struct */
-            pid_t pid;              /* job PID */
+    struct cmd_t {
+            char *buf;              /* the words, cut out of a copy of the line */
+            size_t bufcap;
+            char **argv;            /* every stage's arguments, each NULL-terminated */
+            size_t argcap;
+            struct stage_t stages[MAXSTAGES + 1]; /* ending with a NULL argv */
+            struct globword_t *globs; /* the words to expand */
+            size_t nglobs, globcap;
+            char *names;            /* the paths they expand to */
+            size_t namelen, namecap;
+            size_t *nameoff;        /* where each path starts in names */
+            size_t nnames, nameoffcap;
+            char *pattern;          /* a quoted word made over as a pattern */
+            size_t patterncap;
+            char **gargv;           /* the other argv, built with the paths */
+            size_t gargcap;
+    };
+
+    struct proc_t {             /* One process of a job */
+            pid_t pid;              /* process ID */
+            int stopped;            /* true while stopped by a signal */
+            int status;             /* wait status once reaped, else -1 */
+            int pidfd;              /* pidfd in the epoll set, or -1 */
+            struct job_t *job;      /* the job it belongs to */
+            struct proc_t *next;    /* next stage of the same pipeline */
+            struct proc_t *pidnext; /* next process in the same PID bucket */
+    };
+
+    /* What on sets for each process of a job, see launchattrs */
+    #define ATTR_CPUS 1
+    #define ATTR_NICE 2
+    #define ATTR_MEM  4
+    struct launchattr_t {
+            int set;                /* which of the ATTR_ bits are given */
+            int nice;               /* its niceness */
+            rlim_t mem;             /* its address space limit, in bytes */
+            cpu_set_t cpus;         /* the CPUs it may run on */
+    };
+
+    /* Background jobs that on gave no CPUs are spread one per: */
+    enum { SPREAD_OFF, SPREAD_CPU, SPREAD_NODE };
+    int spread = SPREAD_OFF;    /* set by on spread= */
+
+    /* What timeout on its own sets for background jobs, in ns; 0 for none */
+    long long deftimeout, defgrace;
+
+    struct jobstats_t {         /* The rest of a job, which the reaper seldom needs */
+            struct rusage ru;       /* usage of its reaped processes */
+            struct timespec since;  /* when it last started running */
+            double wall;            /* seconds it ran before that */
+            struct launchattr_t attr; /* what it was launched with */
+            size_t deadline;        /* its place in the deadline heap plus 1, or 0 */
+            long long grace;        /* ns from its SIGTERM to its SIGKILL */
+            int timedout;           /* its deadline has passed */
+    };
+
+    /*
+     * The job struct holds only what the job list and the reaper look at,
+     *    in one 64-byte cache line; the usage counters sit apart in
+     *    stats, and the command line in the cmdline arena.
+     */
+    struct job_t {
+            pid_t pid;              /* job PID, also the process group ID */
             int jid;                /* job ID [1, 2, ...] */
-            int state;              /* UNDEF, BG, FG, or ST */
-            char cmdline[MAXLINE];  /* command line */
+            int nprocs;             /* processes not yet reaped */
+            int nstopped;           /* how many of those are stopped */
+            int status;             /* wait status of the last stage */
+            char state;             /* UNDEF, BG, FG, or ST */
+            char held;              /* a builtin is still adding processes */
+            char timed;             /* report its usage when it is done */
+            char waited;            /* the wait builtin is blocked on it */
+            struct proc_t *procs;   /* its processes, in pipeline order */
+            struct proc_t *lastproc; /* the last of them */
+            char *cmdline;          /* command line, in the cmdline arena */
+            struct jobstats_t *stats; /* its usage, allocated alongside */
+            struct job_t *next;     /* next job on the free list */
+    };
+
+    #define JOBSLAB 64              /* jobs allocated at a time */
+
+    /*
+     * Cmdline arena: command lines are carved out of large chunks in
+     *    multiples of 8 bytes, and a freed one goes on the free list for
+     *    its size, to be handed to the next line of that size. There is
+     *    one list per size up to MAXLINE, so every line gets storage of
+     *    its own size, to within 7 bytes, and nothing is ever returned
+     *    to malloc. The rare longer line is malloc'd on its own.
+     */
+    #define ARENACHUNK (1<<16)      /* bytes malloc'd at a time */
+    struct arena_t {
+            char *next, *end;       /* the unused part of the current chunk */
+            char *free[MAXLINE/8 + 1]; /* freed strings of each size / 8 */
+    };
+    struct arena_t cmdarena;
+
+    /*
+     * The job list is indexed both ways: byjid[] is a growable array
+     * indexed directly by JID, and bypid[] is a chained hash table that
+     * maps the PID of every unreaped process to its proc_t. New jobs get
+     * maxjid+1, as before; maxjid only walks back over the slots freed
+     * above it, so allocation is amortized O(1). A job that would pass
+     * MAXJID takes the lowest free ID instead, so byjid stays bounded
+     * while a long-lived job holds the top. Deleted job and process
+     * structs are kept on free lists rather than freed, so reaping a
+     * burst of children never calls into malloc.
+     */
+    struct jobtable_t {
+            struct job_t **byjid;   /* byjid[jid] is job jid, or NULL */
+            int jidcap;             /* allocated length of byjid */
+            int maxjid;             /* largest allocated job ID */
+            int njobs;              /* number of jobs in the list */
+            struct proc_t **bypid;  /* PID hash buckets */
+            int pidmask;            /* number of buckets - 1 */
+            int nprocs;             /* processes in the hash */
+            int npidfds;            /* how many of them have a pidfd */
+            struct job_t *fg;       /* the foreground job, or NULL */
+            struct job_t *freejobs; /* recycled job structs */
+            struct proc_t *freeprocs; /* recycled process structs */
+    };
+    struct jobtable_t jobtab;           /* The job list */
+    struct jobtable_t *jobs = &jobtab;
+
+    /*
+     * Command path cache: remembers where each command name was found on
+     * $PATH, like the bash hash builtin. The cache is flushed whenever
+     * PATH changes or the mtime of one of its directories changes.
+     */
+    struct cmdpath_t {
+            char *name;             /* command name as typed */
+            char *path;             /* resolved executable */
+            int hits;               /* times the cached path was used */
+            struct cmdpath_t *next; /* next entry in the same bucket */
+    };
+    struct pathdir_t {              /* one directory on $PATH */
+            char *dir;
+            struct timespec mtime;  /* mtime when the cache was filled */
+    };
+    struct cmdpath_t *pathcache[HASHSIZE];
+    struct pathdir_t *pathdirs;     /* the directories on cachedpath */
+    int npathdirs;
+    char *cachedpath;               /* $PATH the cache was built against */
+    long pathhits, pathmisses;      /* cache hit/miss counters */
+
+    /*
+     * Event trace: a ring of the last TRACESIZE job-lifecycle events,
+     *    Each writer claims its own slot with an atomic increment, so a
+     *    signal handler that interrupted a half-written event would fill
+     *    the next slot instead of clobbering it. With tracing off, TRACE
+     *    costs one load and branch.
+     */
+    struct event_t {
+            long long ts;           /* CLOCK_MONOTONIC ns when it began */
+            long long dur;          /* ns it took, or -1 for an instant */
+            int type;               /* EV_* */
+            pid_t pid;              /* process or group it concerns */
+            int arg;                /* signal, wait status or job ID */
     };
-    struct job_t jobs[MAXJOBS]; /* The job list */
+    struct event_t trace[TRACESIZE];
+    unsigned long ntrace;           /* events ever recorded */
+    volatile sig_atomic_t tracing;  /* if true, record events */
+    char *tracefile;                /* -t: where to write it at exit */
+
+    #define TRACE(type, start, pid, arg) \
+            do { if (tracing) traceevent(type, start, pid, arg); } while (0)
     /* End global variables */
 
 
@@ -57,28 +307,104 @@
 
     /* Here are the functions that you will implement */
     void eval(char *cmdline);
+    void runbatch(const char *buf, size_t len);
+    void runscript(char *path);
+    void runserver(char *path);
     int builtin_cmd(char **argv);
+    int isbuiltin(char *name);
+    void do_quit(char **argv);
+    void do_jobs(char **argv);
+    void do_wait(char **argv);
     void do_bgfg(char **argv);
+    void do_parallel(char **argv);
     void waitfg(pid_t pid);
+    int waitinput(int fd);
+    void handlesignals(void);
+    void reapchildren(void);
+    void childchanged(struct proc_t *proc, int stat, const struct rusage *ru);
+    int exitstatus(int stat);
+    void jobwaited(struct job_t *job, int stat);
+    void watchproc(struct jobtable_t *jobs, pid_t pid);
+    void reappidfd(pid_t pid);
+    size_t readline(struct reader_t *r, char **line, size_t *cap);
+    void *grow(void *p, size_t *cap, size_t n, size_t size);
+    pid_t launchjob(struct stage_t *stages, int state, char *cmdline, const sigset_t *mask,
+                    const struct launchattr_t *attr);
+    pid_t launch(struct stage_t *stage, const sigset_t *mask, pid_t pgid, int in, int out,
+                 const struct launchattr_t *attr);
+    int openredirs(struct stage_t *stage);
+    void closeredirs(struct stage_t *stage);
 
     void sigchld_handler(int sig);
     void sigtstp_handler(int sig);
     void sigint_handler(int sig);
 
     /* Here are helper routines that we've provided for you */
-    int parseline(const char *cmdline, char **argv); 
+    int parseline(const char *cmdline, struct cmd_t *cmd); 
+    char **globwords(struct cmd_t *cmd, const char *cmdline, size_t *argc, size_t *first, int nstages);
     void sigquit_handler(int sig);
 
     void clearjob(struct job_t *job);
-    void initjobs(struct job_t *jobs);
-    int maxjid(struct job_t *jobs); 
-    int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-    int deletejob(struct job_t *jobs, pid_t pid); 
-    pid_t fgpid(struct job_t *jobs);
-    struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-    struct job_t *getjobjid(struct job_t *jobs, int jid); 
+    char *savecmd(struct arena_t *a, const char *s);
+    void freecmd(struct arena_t *a, char *s);
+    void initjobs(struct jobtable_t *jobs);
+    int maxjid(struct jobtable_t *jobs); 
+    int addjob(struct jobtable_t *jobs, pid_t pid, int state, char *cmdline);
+    int addproc(struct jobtable_t *jobs, struct job_t *job, pid_t pid);
+    int deletejob(struct jobtable_t *jobs, pid_t pid); 
+    void removejob(struct jobtable_t *jobs, struct job_t *job);
+    void reapproc(struct jobtable_t *jobs, struct proc_t *proc);
+    void addusage(struct rusage *to, const struct rusage *ru);
+    int pruneprocs(struct jobtable_t *jobs, struct job_t *job, int *status, int max);
+    void contjob(struct jobtable_t *jobs, struct job_t *job, int state);
+    void setjobstate(struct jobtable_t *jobs, struct job_t *job, int state);
+    pid_t fgpid(struct jobtable_t *jobs);
+    struct proc_t *getproc(struct jobtable_t *jobs, pid_t pid);
+    struct job_t *getjobpid(struct jobtable_t *jobs, pid_t pid);
+    struct job_t *getjobjid(struct jobtable_t *jobs, int jid); 
     int pid2jid(pid_t pid); 
-    void listjobs(struct job_t *jobs);
+    void listjobs(struct jobtable_t *jobs, int usage);
+    void jobusage(struct job_t *job, struct rusage *ru, double *real);
+    void printusage(const struct rusage *ru, double real);
+    void usagenow(struct rusage *ru);
+    void selfusage(const struct rusage *ru0, const struct timespec *t0);
+
+    char *findcmd(char *name);
+    void clearpathcache(void);
+    void do_hash(char **argv);
+
+    void do_echo(char **argv);
+    void do_printf(char **argv);
+    void do_cd(char **argv);
+    void do_pwd(char **argv);
+    void do_export(char **argv);
+    void do_unset(char **argv);
+    void do_kill(char **argv);
+    void do_true(char **argv);
+    void do_false(char **argv);
+    void do_test(char **argv);
+
+    int launchattrs(char ***argvp, struct launchattr_t *attr);
+    void spreadattrs(struct launchattr_t *attr);
+    int applyattrs(const struct launchattr_t *attr);
+    void printattrs(const struct launchattr_t *attr);
+
+    int timeoutprefix(char ***argvp, long long *ns, long long *grace);
+    void setdeadline(struct job_t *job, long long ns, long long grace);
+    void cleardeadline(struct job_t *job);
+    void expiredeadlines(void);
+
+    void histopen(int persist);
+    void histadd(const char *line);
+    int histidle(void);
+    int histexpand(char **line, size_t *cap);
+    void do_history(char **argv);
+
+    long long tracenow(void);
+    void traceevent(int type, long long start, pid_t pid, int arg);
+    int dumptrace(char *file);
+    void tracexit(void);
+    void do_trace(char **argv);
 
     void usage(void);
     void unix_error(char *msg);
@@ -93,15 +419,19 @@
     int main(int argc, char **argv) 
     {
             char c;
-            char cmdline[MAXLINE];
+            char *cmdline = NULL; /* the line read, grown as needed */
+            size_t cap = 0;
+            char *command = NULL; /* -c command string */
+            char *server = NULL;  /* -S socket path */
             int emit_prompt = 1; /* emit prompt (default) */
+            struct epoll_event wake = {EPOLLIN, {.u64 = EP_WAKE}};
 
             /* Redirect stderr to stdout (so that driver will get all output
              * on the pipe connected to stdout) */
             dup2(1, 2);
 
             /* Parse the command line */
-            while ((c = getopt(argc, argv, "hvp")) != EOF) {
+            while ((c = getopt(argc, argv, "hvpft:c:S:")) != EOF) {
                     switch (c) {
                     case 'h':             /* print help message */
                             usage();
@@ -112,11 +442,35 @@
                     case 'p':             /* don't print a prompt */
                             emit_prompt = 0;  /* handy for automatic testing */
                 break;
+                    case 'f':             /* launch jobs with fork+execve */
+                            usefork = 1;
+                break;
+                    case 't':             /* trace events, write them at exit */
+                            tracing = 1;
+                            tracefile = optarg;
+                            atexit(tracexit);
+                break;
+                    case 'c':             /* run a command string and exit */
+                            command = optarg;
+                break;
+                    case 'S':             /* serve clients on a socket */
+                            server = optarg;
+                break;
         default:
                             usage();
         }
             }
 
+            /* The handlers wake the main flow through this pipe */
+            if (pipe2(wakefd, O_CLOEXEC | O_NONBLOCK) < 0)
+        unix_error("pipe error");
+
+            /* The main flow sleeps on the pipe, stdin and the children's pidfds at once */
+            if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create error");
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd[0], &wake) < 0)
+        unix_error("epoll_ctl error");
+
             /* Install the signal handlers */
 
             /* These are the ones you will need to implement */
@@ -130,6 +484,21 @@
             /* Initialize the job list */
             initjobs(jobs);
 
+            /* Batch mode: run the -c string or the script, then exit */
+            if (command != NULL) {
+        runbatch(command, strlen(command));
+        exit(laststatus);
+            }
+            if (optind < argc) {
+        runscript(argv[optind]);
+        exit(laststatus);
+            }
+            if (server != NULL)
+        runserver(server);        /* never returns */
+
+            /* Lines typed here are kept in the history */
+            histopen(emit_prompt && isatty(STDIN_FILENO));
+
             /* Execute the shell's read/eval loop */
             while (1) {
 
@@ -138,16 +507,18 @@
                 printf("%s", prompt);
                 fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-                app_error("fgets error");
-        if (feof(stdin)) { /* End of file (ctrl-d) */
+        if (readline(&input, &cmdline, &cap) == 0) { /* End of file (ctrl-d) */
                 fflush(stdout);
                 exit(0);
         }
 
+        /* Replace a history event, and record the line */
+        if (histexpand(&cmdline, &cap) < 0)
+                continue;
+        histadd(cmdline);
+
         /* Evaluate the command line */
         eval(cmdline);
-        fflush(stdout);
         fflush(stdout);
             } 
 
@@ -158,181 +529,895 @@
      * eval - Evaluate the command line that the user has just typed in
      * 
      * If the user has requested a built-in command (quit, jobs, bg or fg)
-     * then execute it immediately. Otherwise, fork a child process and
+     * then execute it immediately. Otherwise, launch a child process and
      * run the job in the context of the child. If the job is running in
      * the foreground, wait for it to terminate and then return.  Note:
      * each child process must have a unique process group ID so that our
      * background children don't receive SIGINT (SIGTSTP) from the kernel
      * when we type ctrl-c (ctrl-z) at the keyboard.  
+     *
+     * A line starting with "time" runs the rest of it the same way and
+     * prints what it used once it is done: for a job, when its last
+     * process has been reaped, even if it was stopped and continued on
+     * the way; for a builtin, what the shell itself used running it.
+     *
+     * A line starting with "on" and launch attributes (see launchattrs)
+     * runs the rest of it with those set in each of its processes, and
+     * one starting with "timeout" and a duration gives its job that
+     * long before it is killed (see expiredeadlines).
     */
 void eval(char *cmdline){
-         sigset_t set1;  
-         sigemptyset(&set1);  
-         sigaddset(&set1,SIGCHLD);
+         sigset_t mask;
             int bg;
             int stat;
-            char *argv[MAXARGS];
-            bg = parseline(cmdline,argv);
+            int timed;
+            static struct cmd_t cmd;        /* kept for the next line */
+            char **argv;
+            struct stage_t *stages = cmd.stages;
+            struct rusage ru0;
+            struct timespec t0;
+            struct launchattr_t attr;
+            long long timeout = 0, grace = 0;
+            long long t = tracenow();
+            bg = parseline(cmdline,&cmd);
+            argv = cmd.argv;
+            TRACE(EV_PARSE,t,0,0);
 
             pid_t cpid;
             
-        if(!builtin_cmd(argv)){
-                sigprocmask(SIG_BLOCK,&set1,NULL);
-                if(bg)          stat=BG;
-                else            stat = FG;
+        if(argv[0] == NULL)     /* blank line or syntax error */
+                return;
+        if(stdout0 != NULL)     /* a job server client has no terminal to give a job */
+                bg = 1;
+        if((timed = strcmp(argv[0],"time") == 0)){
+                if(*++stages[0].argv == NULL)
+                        return;
+                usagenow(&ru0);
+                clock_gettime(CLOCK_MONOTONIC,&t0);
+        }
+        if(strcmp(stages[0].argv[0],"timeout") == 0 &&
+           (timeoutprefix(&stages[0].argv,&timeout,&grace) < 0 || stages[0].argv[0] == NULL))
+                return;         /* a bad duration, or just setting the default */
+        attr.set = 0;
+        if(strcmp(stages[0].argv[0],"on") == 0 &&
+           (launchattrs(&stages[0].argv,&attr) < 0 || stages[0].argv[0] == NULL))
+                return;         /* a bad attribute, or just on spread= */
+        t = tracenow();
+        if(stages[1].argv == NULL && stages[0].nredirs == 0 && builtin_cmd(stages[0].argv)){
+                TRACE(EV_BUILTIN,t,0,0);
+                if(timed)
+                        selfusage(&ru0,&t0);
+                return;
+        }
 
-                
-                cpid = fork();
-                switch(cpid){
-                        /*In case fork fail*/
-                        case -1:
-                               return;
-                        /*Child creates its own process group 
-                         * if argument is valid
-                         */
-                        case 0:{
-                                setpgid(0,0);
-                                if(execvp(argv[0],argv) == -1){
-                                        printf("%s: Command not found\n",argv[0]);
-                                        exit(0);
+        if(bg)          stat=BG;
+        else            stat = FG;
+        if(bg && spread != SPREAD_OFF && !(attr.set & ATTR_CPUS))
+                spreadattrs(&attr);
+        if(bg && timeout == 0){
+                timeout = deftimeout;
+                grace = defgrace;
+        }
+
+        /*
+         * Children start with the shell's signal mask. Nothing reaps
+         * outside handlesignals, so the job is sure to be on the list
+         * until we next wait.
+         */
+        sigprocmask(SIG_BLOCK,NULL,&mask);
+        if((cpid = launchjob(stages,stat,cmdline,&mask,attr.set ? &attr : NULL)) == 0){
+                if(timed)
+                        selfusage(&ru0,&t0);
+                return;
+        }
+        if(timed)
+                getjobpid(jobs,cpid)->timed = 1;
+        if(timeout > 0)
+                setdeadline(getjobpid(jobs,cpid),timeout,grace);
+
+        if(bg){
+                struct job_t *job = getjobpid(jobs,cpid);
+                printf("[%d] (%d)   %s",job->jid,job->pid,job->cmdline);
+                laststatus = 0;         /* it started, whatever a stage did */
+                return;
+        }
+        waitfg(cpid);   /*(custom) wait for child*/
+            return;
+}
+
+    /* grow - Make sure an array of cap elements of size size holds n */
+    void *grow(void *p, size_t *cap, size_t n, size_t size)
+    {
+        if(n <= *cap)
+                return p;
+        while(*cap < n)
+                *cap = *cap ? 2 * *cap : 16;
+        if((p = realloc(p,*cap * size)) == NULL)
+                unix_error("realloc error");
+        return p;
+    }
+
+    /* linemax - Longest line that can be run: the kernel's ARG_MAX */
+    static size_t linemax(void)
+    {
+        static size_t max;
+
+        if(max == 0)
+                max = sysconf(_SC_ARG_MAX);
+        return max;
+    }
+
+    /*
+     * readline - Read the next line from r into *line, NUL-terminated.
+     *    Like getline, *line is a malloc'd buffer of *cap bytes that is
+     *    grown to fit, so the caller keeps it from line to line and a
+     *    short line is read with no allocation. While no whole line is
+     *    buffered it waits in waitinput, so children are reaped and
+     *    reported while the shell sits at the prompt. A last line
+     *    without a newline gets one. A line longer than ARG_MAX could
+     *    never be run, so it is read through and dropped, and an empty
+     *    line is returned instead. Returns the line's length, or 0 at
+     *    end of file.
+     */
+    size_t readline(struct reader_t *r, char **line, size_t *cap)
+    {
+        size_t n = 0, take;
+        int toolong = 0;
+        ssize_t got;
+        char *nl;
+
+        *line = grow(*line,cap,MAXLINE,1);
+        while(1){
+                nl = memchr(r->buf + r->start,'\n',r->end - r->start);
+                take = nl != NULL ? nl - (r->buf + r->start) + 1 : r->end - r->start;
+                if(toolong || n + take >= linemax())
+                        toolong = 1;
+                else if(take > 0){
+                        *line = grow(*line,cap,n + take + 2,1);
+                        memcpy(*line + n,r->buf + r->start,take);
+                        n += take;
+                }
+                r->start += take;
+                if(nl != NULL || r->eof)
+                        break;
+
+                /* All of the buffer is in the line, so refill it from the start */
+                r->start = r->end = 0;
+                handlesignals();
+                fflush(stdout);         /* show what that printed before we sleep */
+                if(!waitinput(r->fd))
+                        continue;
+                if((got = read(r->fd,r->buf,sizeof(r->buf))) < 0){
+                        if(errno == EINTR || errno == EAGAIN)
+                                continue;
+                        app_error("read error");
+                }
+                if(got == 0)
+                        r->eof = 1;
+                r->end = got;
+        }
+
+        if(toolong){
+                printf("tsh: line too long\n");
+                n = 0;
+                (*line)[n++] = '\n';
+        }
+        else if(n > 0 && (*line)[n-1] != '\n')
+                (*line)[n++] = '\n';
+        (*line)[n] = '\0';
+        return n;
+    }
+
+    /*
+     * runbatch - Run the lines of a script held in memory. Nothing is
+     *    tokenized ahead of time: each line is found with memchr only
+     *    when its turn comes, and blank and comment lines are skipped
+     *    without going through eval. Output collects in a large stdio
+     *    buffer that launchjob flushes before starting any child, so it
+     *    only reaches the descriptor at job boundaries, or once per line
+     *    when stdout is a terminal.
+     */
+    void runbatch(const char *buf, size_t len)
+    {
+        const char *end = buf + len, *eol, *p;
+        char *cmdline = NULL;
+        size_t n, cap = 0;
+        int lineno = 0;
+
+        setvbuf(stdout,NULL,isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF,1 << 16);
+        for(; buf < end; buf = eol + 1){
+                lineno++;
+                if((eol = memchr(buf,'\n',end - buf)) == NULL)
+                        eol = end;
+                for(p = buf; p < eol && (*p == ' ' || *p == '\t'); p++)
+                        ;
+                if(p == eol || *p == '#')
+                        continue;
+                if((n = eol - buf) >= linemax()){
+                        printf("tsh: line %d: too long\n",lineno);
+                        continue;
+                }
+                cmdline = grow(cmdline,&cap,n + 2,1);
+                memcpy(cmdline,buf,n);
+                cmdline[n] = '\n';
+                cmdline[n+1] = '\0';
+                handlesignals();        /* report bg jobs done since the last line */
+                eval(cmdline);
+        }
+        free(cmdline);
+        fflush(stdout);
+    }
+
+    /* runscript - Map a script file into memory and run it */
+    void runscript(char *path)
+    {
+        struct stat st;
+        char *buf;
+        int fd;
+
+        if((fd = open(path,O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd,&st) < 0){
+                printf("%s: %s\n",path,strerror(errno));
+                exit(1);
+        }
+        if(st.st_size > 0){
+                if((buf = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0)) == MAP_FAILED)
+                        unix_error("mmap error");
+                madvise(buf,st.st_size,MADV_SEQUENTIAL);
+                runbatch(buf,st.st_size);
+                munmap(buf,st.st_size);
+        }
+        close(fd);
+    }
+
+    /*
+     * capture - Run a builtin with its output going to a memory file
+     *    instead of stdout, and return that file. For a job server
+     *    client stdout is the reply being collected, so the builtin
+     *    gets the real one back while it runs.
+     */
+    static int capture(char **argv)
+    {
+        int fd, saved;
+        FILE *out = stdout;
+
+        if((fd = memfd_create("tsh-builtin",MFD_CLOEXEC)) < 0)
+                unix_error("memfd_create error");
+        fflush(stdout);
+        if(stdout0 != NULL)
+                stdout = stdout0;
+        saved = dup(STDOUT_FILENO);
+        dup2(fd,STDOUT_FILENO);
+        builtin_cmd(argv);
+        fflush(stdout);
+        dup2(saved,STDOUT_FILENO);
+        close(saved);
+        stdout = out;
+        return fd;
+    }
+
+    /*
+     * relay - Copy a builtin's captured output to where it should go,
+     *    without passing it through user space. Into the pipe to the
+     *    next stage it goes with splice; the pipe is first grown to hold
+     *    all of it where the kernel allows, so a slow reader rarely holds
+     *    the shell up, and a reader that exits early just ends the copy.
+     *    Into a file it goes with copy_file_range, or sendfile where that
+     *    can't be used, as for ttys. Both refuse O_APPEND targets, which
+     *    get a plain read/write loop.
+     */
+    static void relay(int from, int to)
+    {
+        off_t off = 0, size = lseek(from,0,SEEK_END);
+        char buf[MAXLINE];
+        handler_t *old;
+        struct stat st;
+        ssize_t n;
+
+        if(fstat(to,&st) == 0 && S_ISFIFO(st.st_mode)){
+                if(size > 0)
+                        fcntl(to,F_SETPIPE_SZ,(int)(size < INT_MAX ? size : INT_MAX));
+                old = Signal(SIGPIPE,SIG_IGN);
+                while(off < size && splice(from,&off,to,NULL,size - off,0) > 0)
+                        ;
+                Signal(SIGPIPE,old);
+                return;
+        }
+
+        while(off < size && copy_file_range(from,&off,to,NULL,size - off,0) > 0)
+                ;
+        while(off < size && sendfile(to,from,&off,size - off) > 0)
+                ;
+        while(off < size && (n = pread(from,buf,MAXLINE,off)) > 0 && write(to,buf,n) == n)
+                off += n;
+    }
+
+    /*
+     * launchjob - Start the stages of a pipeline, connected by pipes, in
+     *    one process group led by the first process, and add them to the
+     *    job list as a single job. A builtin runs in the shell instead:
+     *    writing to the terminal it just prints, otherwise its output is
+     *    captured and relayed into the next pipe or redirected file once
+     *    the rest of the pipeline is running. A builtin reads the pipe
+     *    from the previous stage, or its input redirection, through
+     *    builtin_in. Each process gets the launch attributes attr, unless
+     *    that is NULL. Returns the job's PID, or 0 if no process was
+     *    started.
+     */
+    pid_t launchjob(struct stage_t *stages, int state, char *cmdline, const sigset_t *mask,
+                    const struct launchattr_t *attr)
+    {
+        struct job_t *job = NULL;
+        int relayfrom[MAXSTAGES], relayto[MAXSTAGES], relaypipe[MAXSTAGES], nrelay = 0;
+        int fds[2], in = STDIN_FILENO, out, src, dest, i, r;
+        int last = -1, lastin = STDIN_FILENO, lastpipe = 0;
+        pid_t pid, pgid = 0;
+
+        /* Children write straight to the descriptors, so get ours out first */
+        fflush(stdout);
+        for(i = 0; stages[i].argv != NULL; i++){
+                out = STDOUT_FILENO;
+                if(stages[i+1].argv != NULL){
+                        if(pipe2(fds,O_CLOEXEC) < 0)
+                                unix_error("pipe error");
+                        out = fds[1];
+                }
+
+                if(openredirs(&stages[i]) < 0)
+                        ;       /* the stage is skipped, like a bad command */
+                else if(!isbuiltin(stages[i].argv[0])){
+                        if((pid = launch(&stages[i],mask,pgid,in,out,attr)) > 0){
+                                if(pgid == 0){
+                                        pgid = pid;
+                                        if(!addjob(jobs,pid,state,cmdline)){
+                                                Kill(-pid,SIGKILL);
+                                                waitpid(pid,NULL,0);
+                                                pgid = -1;
+                                        }
+                                        if((job = getjobpid(jobs,pid)) != NULL && attr != NULL)
+                                                job->stats->attr = *attr;
                                 }
-                                           
+                                else if(job != NULL)
+                                        addproc(jobs,job,pid);
+                                watchproc(jobs,pid);
                         }
-                        /*
-                         * Parent will add the job and block the incoming signals and
-                         * Check if the process should run in background or foreground
-                         */
-                        default:{
-                                
-                                addjob(jobs,cpid,stat,cmdline);
-                                sigprocmask(SIG_UNBLOCK,&set1,NULL);
-                                
-                                if(bg){
-                                        struct job_t *job = getjobpid(jobs,cpid);
-                                        printf("[%d] (%d)   %s",job->jid,job->pid,job->cmdline);
-                                        return;
-                                }
-                                else    waitfg(cpid);   /*(custom) wait for child*/
+                }
+                /* Job control can't be run from inside a pipeline */
+                else if(stages[1].argv != NULL && (!strcmp(stages[i].argv[0],"fg") ||
+                        !strcmp(stages[i].argv[0],"bg") || !strcmp(stages[i].argv[0],"quit")))
+                        printf("%s: not allowed in a pipeline\n",stages[i].argv[0]);
+                else{
+                        /* The builtin's stdin and stdout are its last redirections, if any */
+                        src = in;
+                        dest = out;
+                        for(r = 0; r < stages[i].nredirs; r++){
+                                if(stages[i].redirs[r].fd == STDIN_FILENO)
+                                        src = stages[i].redirs[r].src;
+                                if(stages[i].redirs[r].fd == STDOUT_FILENO)
+                                        dest = stages[i].redirs[r].src;
+                        }
+                        if(dest == STDOUT_FILENO){
+                                last = i;
+                                lastin = src;
+                                if((lastpipe = in == src && in != STDIN_FILENO))
+                                        in = -1;        /* closed after it runs */
+                        }
+                        else{
+                                builtin_in = src;
+                                relayfrom[nrelay] = capture(stages[i].argv);
+                                builtin_in = STDIN_FILENO;
+                                relayto[nrelay] = dest;
+                                relaypipe[nrelay++] = dest == out;
+                                if(dest == out)
+                                        out = -1;       /* closed after the relay */
                         }
-               
                 }
-        
+
+                if(in != STDIN_FILENO && in != -1)
+                        close(in);
+                if(out != STDOUT_FILENO && out != -1)
+                        close(out);
+                in = stages[i+1].argv != NULL ? fds[0] : STDIN_FILENO;
         }
-            return;
-}
+
+        for(i = 0; i < nrelay; i++){
+                relay(relayfrom[i],relayto[i]);
+                close(relayfrom[i]);
+                if(relaypipe[i])
+                        close(relayto[i]);
+        }
+        if(last >= 0){
+                builtin_in = lastin;
+                builtin_cmd(stages[last].argv);
+                builtin_in = STDIN_FILENO;
+                if(lastpipe)
+                        close(lastin);
+        }
+        for(i = 0; stages[i].argv != NULL; i++)
+                closeredirs(&stages[i]);
+        return pgid > 0 ? pgid : 0;
+    }
+
+    /*
+     * openredirs - Open the files named by a stage's redirections. The
+     *    shell opens them, close-on-exec, so it can report a missing file
+     *    by name; the child only has to dup them into place. Returns 0,
+     *    or -1 if one of them could not be opened.
+     */
+    int openredirs(struct stage_t *stage)
+    {
+        struct redir_t *r;
+        int i, flags;
+
+        for(i = 0; i < stage->nredirs; i++){
+                r = &stage->redirs[i];
+                if(r->file == NULL)
+                        continue;
+                if(r->fd == STDIN_FILENO)
+                        flags = O_RDONLY;
+                else
+                        flags = O_WRONLY | O_CREAT | (r->append ? O_APPEND : O_TRUNC);
+                if((r->src = open(r->file,flags | O_CLOEXEC,0666)) < 0){
+                        printf("%s: %s\n",r->file,strerror(errno));
+                        closeredirs(stage);
+                        return -1;
+                }
+        }
+        return 0;
+    }
+
+    /* closeredirs - Close whatever openredirs opened for a stage */
+    void closeredirs(struct stage_t *stage)
+    {
+        struct redir_t *r;
+        int i;
+
+        for(i = 0; i < stage->nredirs; i++){
+                r = &stage->redirs[i];
+                if(r->file != NULL && r->src >= 0){
+                        close(r->src);
+                        r->src = -1;
+                }
+        }
+    }
+
+    /*
+     * launch - Start argv[0] as a child process in process group pgid
+     *    (or a new group it leads, if pgid is 0), with in and out as its
+     *    stdin and stdout and then the stage's redirections applied in
+     *    order, and with the signal mask set to mask.
+     *    The command is resolved through the path cache first, so an
+     *    unknown command fails here without creating a child at all.
+     *    By default this is posix_spawn, which glibc implements with
+     *    clone(CLONE_VM|CLONE_VFORK) so its cost doesn't grow with the
+     *    shell's address space. With -f it is the classic fork+execve,
+     *    and so it is when there are launch attributes to apply, which
+     *    posix_spawn has no way to set; a child that can't take them
+     *    says so and exits without running the command.
+     *    Returns the child's PID, or 0 if no job should be added, with
+     *    laststatus 127 for a command not found.
+     */
+    pid_t launch(struct stage_t *stage, const sigset_t *mask, pid_t pgid, int in, int out,
+                 const struct launchattr_t *attr)
+    {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t spattr;
+        char **argv = stage->argv;
+        char *path;
+        long long t;
+        pid_t pid;
+        int err, i;
+
+        if((path = findcmd(argv[0])) == NULL){
+                printf("%s: Command not found\n",argv[0]);
+                laststatus = 127;
+                return 0;
+        }
+
+        t = tracenow();
+        if(usefork || attr != NULL){
+                if((pid = fork()) < 0){
+                        printf("fork error: %s\n",strerror(errno));
+                        return 0;
+                }
+                /*Child joins its process group and restores the mask*/
+                if(pid == 0){
+                        sigprocmask(SIG_SETMASK,mask,NULL);
+                        setpgid(0,pgid);
+                        if(in != STDIN_FILENO)
+                                dup2(in,STDIN_FILENO);
+                        if(out != STDOUT_FILENO)
+                                dup2(out,STDOUT_FILENO);
+                        for(i = 0; i < stage->nredirs; i++)
+                                dup2(stage->redirs[i].src,stage->redirs[i].fd);
+                        if(attr != NULL && applyattrs(attr) < 0)
+                                exit(126);
+                        if(execve(path,argv,environ) == -1){
+                                printf("%s: %s\n",argv[0],errno == E2BIG ? strerror(errno) : "Command not found");
+                                exit(errno == E2BIG ? 126 : 127);
+                        }
+                }
+                TRACE(EV_FORK,t,pid,0);
+
+                /* Also set it from the parent so a kill(-pid) can't race the child */
+                t = tracenow();
+                setpgid(pid,pgid ? pgid : pid);
+                TRACE(EV_SETPGID,t,pid,pgid ? pgid : pid);
+                return pid;
+        }
+
+        /* Pipe descriptors are close-on-exec, so only the dups are needed */
+        posix_spawn_file_actions_init(&actions);
+        if(in != STDIN_FILENO)
+                posix_spawn_file_actions_adddup2(&actions,in,STDIN_FILENO);
+        if(out != STDOUT_FILENO)
+                posix_spawn_file_actions_adddup2(&actions,out,STDOUT_FILENO);
+        for(i = 0; i < stage->nredirs; i++)
+                posix_spawn_file_actions_adddup2(&actions,stage->redirs[i].src,stage->redirs[i].fd);
+        posix_spawnattr_init(&spattr);
+        posix_spawnattr_setflags(&spattr,POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setpgroup(&spattr,pgid);
+        posix_spawnattr_setsigmask(&spattr,mask);
+        err = posix_spawn(&pid,path,&actions,&spattr,argv,environ);
+        posix_spawnattr_destroy(&spattr);
+        posix_spawn_file_actions_destroy(&actions);
+        if(err != 0){
+                printf("%s: %s\n",argv[0],err == E2BIG ? strerror(err) : "Command not found");
+                laststatus = err == E2BIG ? 126 : 127;
+                return 0;
+        }
+        /* glibc returns once the child has exec'd, so this spans both */
+        TRACE(EV_SPAWN,t,pid,0);
+        return pid;
+    }
+
+    /*
+     * What ends a run of literal characters in a word, outside quotes
+     *    and inside double quotes. The terminating NUL always does.
+     */
+    #define PLAINSTOP  " \t\n'\"\\|&*?["
+    #define DQUOTESTOP "\"\\"
+
+    /*
+     * redirop - Length of the redirection operator word at p: "<", ">",
+     *    ">>" or "2>&1" standing on its own, else 0. Unlike | and &,
+     *    these need spaces around them, so that "tsh>" stays a word.
+     */
+    static int redirop(const char *p)
+    {
+            static const char *ops[] = {"2>&1", ">>", ">", "<"};
+            size_t n;
+            int i;
+
+            for (i = 0; i < 4; i++) {
+        n = strlen(ops[i]);
+        if (strncmp(p, ops[i], n) == 0 &&
+            (p[n] == ' ' || p[n] == '\t' || p[n] == '\n' || p[n] == '\0'))
+                return n;
+            }
+            return 0;
+    }
 
     /* 
      * parseline - Parse the command line and build the argv array.
      * 
-     * Characters enclosed in single quotes are treated as a single
-     * argument.  Return true if the user has requested a BG job, false if
-     * the user has requested a FG job.  
+     * The line is tokenized in a single pass, left to right. The words
+     * end up in cmd->buf and cmd->argv points into it; cmdline is left
+     * as it was, for the job list. Both are grown to fit, so there is
+     * no limit on a line's length or its number of words here.
+     * A word is made of runs of literal characters joined across quotes
+     * and backslashes: 'single quotes' keep everything up to the next
+     * quote, "double quotes" keep everything but a backslash that
+     * escapes one of \ " $ ` or a newline, and outside quotes a
+     * backslash escapes any character.
+     *
+     * The line is copied into buf whole, and each word is cut out where
+     * it lies, so a plain word costs one scan and a NUL. Only a word
+     * with quotes or escapes in it has its runs moved up over them. The
+     * runs are found with strcspn and strchrnul, which glibc runs 16 or
+     * 32 bytes at a time with SSE4.2 or AVX2, chosen for the CPU when
+     * the shell starts.
+     *
+     * An unquoted "|" separates the stages of a pipeline, with or
+     * without spaces: it is replaced by NULL in argv, so each stage's
+     * argv is NULL-terminated in place, and cmd->stages[] points at the
+     * start of each one, ending with a NULL argv. There can be up to
+     * MAXSTAGES of them. "<", ">", ">>" and
+     * "2>&1" words, with the file name that follows the first three,
+     * become the stage's redirections rather than arguments. An
+     * unquoted "&", spaced or not, ends the line and makes it a
+     * background job. Return true if the user has requested a BG job,
+     * false if the user has requested a FG job.
      */
-    int parseline(const char *cmdline, char **argv) 
+    int parseline(const char *cmdline, struct cmd_t *cmd) 
     {
-            static char array[MAXLINE]; /* holds local copy of command line */
-            char *buf = array;          /* ptr that traverses command line */
-            char *delim;                /* points to first space delimiter */
-            int argc;                   /* number of args */
-            int bg;                     /* background job? */
+            const char *p = cmdline;    /* next character to read */
+            char *buf, *q;              /* the words, and where this one goes */
+            char **argv;                /* argument list */
+            size_t argc = 0;            /* number of args */
+            size_t room;                /* args that fit before argv must grow */
+            size_t first[MAXSTAGES];    /* where each stage's args start */
+            int bg = 0;                 /* background job? */
+            int nstages = 0;            /* index of the current stage */
+            struct stage_t *stages = cmd->stages;
+            struct stage_t *stage;      /* the current stage */
+            struct redir_t *file = NULL; /* redirection awaiting a file name */
+            const char *s, *w;          /* w: where the word was typed */
+            int isarg, quoted, glob;    /* what the word is and has in it */
+            size_t n;
 
-            strcpy(buf, cmdline);
-            buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-            while (*buf && (*buf == ' ')) /* ignore leading spaces */
-        buf++;
-
-            /* Build the argv list */
-            argc = 0;
-            if (*buf == '\'') {
-        buf++;
-        delim = strchr(buf, '\'');
-            }
-            else {
-        delim = strchr(buf, ' ');
-            }
+            n = strlen(cmdline) + 1;
+            buf = cmd->buf = grow(cmd->buf, &cmd->bufcap, n, 1);
+            argv = cmd->argv = grow(cmd->argv, &cmd->argcap, MAXARGS, sizeof(char *));
+            room = cmd->argcap - 1;
+            memcpy(buf, cmdline, n);
+            stage = &stages[0];
+            stage->nredirs = 0;
+            first[0] = 0;
+            cmd->nglobs = 0;
+            while (1) {
+        while (*p == ' ' || *p == '\t' || *p == '\n') /* ignore spaces */
+                p++;
+        if (*p == '\0')
+                break;
+        if (bg)                 /* nothing may follow the & */
+                goto syntax;
+        if (argc == room) {             /* keep room for this word and a NULL */
+                argv = cmd->argv = grow(argv, &cmd->argcap, argc + 2, sizeof(char *));
+                room = cmd->argcap - 1;
+        }
 
-            while (delim) {
-        argv[argc++] = buf;
-        *delim = '\0';
-        buf = delim + 1;
-        while (*buf && (*buf == ' ')) /* ignore spaces */
-                     buf++;
+        if (*p == '|') {
+                if (file != NULL || argc == first[nstages] || nstages == MAXSTAGES - 1)
+                        goto syntax;
+                p++;
+                argv[argc++] = NULL;
+                stage = &stages[++nstages];
+                first[nstages] = argc;
+                stage->nredirs = 0;
+                continue;
+        }
+        if (*p == '&') {
+                p++;
+                bg = 1;
+                continue;
+        }
+        if ((*p == '<' || *p == '>' || *p == '2') && (n = redirop(p)) > 0) {
+                if (file != NULL || stage->nredirs == MAXREDIRS)
+                        goto syntax;
+                file = &stage->redirs[stage->nredirs++];
+                file->fd = p[0] == '<' ? STDIN_FILENO : STDOUT_FILENO;
+                file->src = -1;
+                file->append = p[1] == '>';
+                file->file = NULL;
+                if (p[0] == '2') {              /* 2>&1 takes no file name */
+                        file->fd = STDERR_FILENO;
+                        file->src = STDOUT_FILENO;
+                        file = NULL;
+                }
+                p += n;
+                continue;
+        }
 
-        if (*buf == '\'') {
-                buf++;
-                delim = strchr(buf, '\'');
+        /*
+         * A word: its literal runs are already in place in buf, until a
+         * quote or escape has been dropped; from then on they are moved
+         * up, to the end of the word
+         */
+        q = buf + (p - cmdline);
+        w = p;
+        isarg = file == NULL;
+        quoted = glob = 0;
+        if (file != NULL) {
+                file->file = q;
+                file = NULL;
         }
-        else {
-                delim = strchr(buf, ' ');
+        else
+                argv[argc++] = q;
+        while (1) {
+                s = p + strcspn(p, PLAINSTOP);
+                if (q - buf != p - cmdline)
+                        memcpy(q, p, s - p);
+                q += s - p;
+                p = s;
+                if (*p == '\'') {
+                        quoted = 1;
+                        s = strchrnul(++p, '\'');
+                        if (*s != '\'')
+                                goto syntax;
+                        memcpy(q, p, s - p);       /* always: the quote came out */
+                        q += s - p;
+                        p = s + 1;
+                }
+                else if (*p == '"') {
+                        quoted = 1;
+                        p++;
+                        while (1) {
+                                s = p + strcspn(p, DQUOTESTOP);
+                                memcpy(q, p, s - p);
+                                q += s - p;
+                                p = s;
+                                if (*p != '\\')
+                                        break;
+                                if (p[1] == '\\' || p[1] == '"' || p[1] == '$' ||
+                                    p[1] == '`' || p[1] == '\n')
+                                        p++;    /* drop the backslash */
+                                if (*p != '\n')  /* an escaped newline joins lines */
+                                        *q++ = *p;
+                                p++;
+                        }
+                        if (*p++ != '"')
+                                goto syntax;
+                }
+                else if (*p == '\\') {
+                        quoted = 1;
+                        if (*++p != '\n' && *p != '\0')
+                                *q++ = *p;
+                        if (*p != '\0')
+                                p++;
+                }
+                else if (*p == '*' || *p == '?' || *p == '[') {
+                        *q++ = *p++;    /* a wildcard, so the word is a pattern */
+                        glob = 1;
+                }
+                else
+                        break;
+        }
+        *q = '\0';
+        if (glob && isarg) {
+                cmd->globs = grow(cmd->globs, &cmd->globcap, cmd->nglobs + 1, sizeof(*cmd->globs));
+                cmd->globs[cmd->nglobs++] = (struct globword_t){argc - 1, w - cmdline, p - cmdline, quoted, 0, 0};
         }
             }
             argv[argc] = NULL;
-            
-            if (argc == 0)  /* ignore blank line */
-        return 1;
 
-            /* should the job run in the background? */
-            if ((bg = (*argv[argc-1] == '&')) != 0) {
-        argv[--argc] = NULL;
-            }
+            /* Put what the patterns match in their place */
+            if (cmd->nglobs > 0)
+        argv = globwords(cmd, cmdline, &argc, first, nstages);
+
+            /* argv may have moved as it grew, so the stages point into it last */
+            for (n = 0; n <= (size_t)nstages; n++)
+        stages[n].argv = &argv[first[n]];
+            stages[n].argv = NULL;
+
+            if (file != NULL)
+        goto syntax;
+            if (argc == 0 && stage->nredirs == 0 && !bg)  /* ignore blank line */
+        return 1;
+            if (argc == first[nstages])
+        goto syntax;
             return bg;
+
+     syntax:
+            printf("syntax error near unexpected token\n");
+            argv[0] = NULL;
+            stages[0].argv = NULL;
+            return 1;
     }
 
-    /* 
-     * builtin_cmd - If the user has typed a built-in command then execute
-     *    it immediately.  
+    /*
+     * quit - Execute the builtin quit command, unless jobs are stopped
      */
-    int builtin_cmd(char **argv) 
+    void do_quit(char **argv)
     {
+            int jid;
+
                 /*
                  * Checking if process are stopped in the background 
                  * Then the shell should prompt a message to stop the jobs.
                  * We will get the shell prompt back       
                  */
-            if(strcmp(argv[0],"quit") == 0)
-            {
-                int i;
-                for(i = 0;i<MAXJOBS;i++)
+                for(jid = 1;jid <= maxjid(jobs);jid++)
                 {
-                    if(jobs[i].state == ST)     
+                    if(jobs->byjid[jid] != NULL && jobs->byjid[jid]->state == ST)     
                         {
                             printf("There are jobs which are stopped!! Terminate them\nUse kill -9 <pid>\n");
-                            listjobs(jobs);
-                            return 1;
+                            listjobs(jobs,0);
+                            laststatus = 1;
+                            return;
                         }
                 }
                     exit(0);
-            }
-            /*List the current jobs*/
-            if(strcmp(argv[0],"jobs") == 0)
-            {
-                    listjobs(jobs);
-                    return 1;
-            }
+    }
 
-            /*For job control: foregrounding or backgrounding the jobs using do_bgfg*/
-            if(strcmp(argv[0],"fg") == 0 || strcmp(argv[0],"bg") == 0)
-            {
-                    do_bgfg(argv);
-                    return 1;
-            }
-            return 0;     /* not a builtin command */
+    /*List the current jobs, with -l what each has used so far*/
+    void do_jobs(char **argv)
+    {
+            listjobs(jobs,argv[1] != NULL && strcmp(argv[1],"-l") == 0);
     }
 
+    /*
+     * The builtins are found through a perfect hash of the name: its
+     * first and last characters plus its length, mod 64, which gives
+     * every name below a slot of its own. BSLOT works it out at compile
+     * time, so the table is laid out by the compiler and a lookup is one
+     * hash and one strcmp. A new name has to land in a free slot, or
+     * the hash be changed; tshbench builtins checks every name.
+     */
+    #define BSLOT(first, last, len) (((first) + (last) + (len)) & 63)
 
-        /*
-         * check if the current string is number or not
-         */
-     int numbers_only(const char *s)
+    struct builtin_t {
+            char *name;
+            void (*run)(char **argv);
+            int blocks;             /* waits on jobs, so job server clients can't use it */
+    };
+
+    static const struct builtin_t builtins[64] = {
+            [BSLOT('q','t',4)] = {"quit", do_quit},
+            [BSLOT('j','s',4)] = {"jobs", do_jobs},
+            [BSLOT('f','g',2)] = {"fg", do_bgfg, 1},
+            [BSLOT('b','g',2)] = {"bg", do_bgfg},
+            [BSLOT('w','t',4)] = {"wait", do_wait, 1},
+            [BSLOT('h','h',4)] = {"hash", do_hash},           /* the command path cache */
+            [BSLOT('t','e',5)] = {"trace", do_trace},         /* record job events */
+            [BSLOT('p','l',8)] = {"parallel", do_parallel, 1},   /* fan a command out */
+            [BSLOT('e','o',4)] = {"echo", do_echo},
+            [BSLOT('p','f',6)] = {"printf", do_printf},
+            [BSLOT('c','d',2)] = {"cd", do_cd},
+            [BSLOT('p','d',3)] = {"pwd", do_pwd},
+            [BSLOT('e','t',6)] = {"export", do_export},
+            [BSLOT('u','t',5)] = {"unset", do_unset},
+            [BSLOT('k','l',4)] = {"kill", do_kill},
+            [BSLOT('t','e',4)] = {"true", do_true},
+            [BSLOT('f','e',5)] = {"false", do_false},
+            [BSLOT('t','t',4)] = {"test", do_test},
+            [BSLOT('[','[',1)] = {"[", do_test},
+            [BSLOT('h','y',7)] = {"history", do_history},     /* the lines typed at the prompt */
+    };
+
+    /* findbuiltin - The builtin called name, or NULL */
+    const struct builtin_t *findbuiltin(const char *name)
     {
-            while (*s) {
-                    if (isdigit(*s++) == 0) return 0;
-            }
+            const struct builtin_t *b;
+            size_t len = strlen(name);
 
-            return 1;
+            if(len == 0)
+                return NULL;
+            b = &builtins[BSLOT((unsigned char)name[0],(unsigned char)name[len-1],len)];
+            return b->name != NULL && strcmp(b->name,name) == 0 ? b : NULL;
     }
 
-
+    /* 
+     * builtin_cmd - If the user has typed a built-in command then execute
+     *    it immediately. Its exit status is left in laststatus.
+     */
+    int builtin_cmd(char **argv) 
+    {
+            const struct builtin_t *b;
+
+            if((b = findbuiltin(argv[0])) == NULL)
+                return 0;     /* not a builtin command */
+            laststatus = 0;
+            if(b->blocks && stdout0 != NULL){
+                printf("%s: not available to job server clients\n",argv[0]);
+                laststatus = 2;
+                return 1;
+            }
+            b->run(argv);
+            return 1;
+    }
+
+
+    /*
+     * isbuiltin - True if name is one of the commands builtin_cmd runs
+     */
+    int isbuiltin(char *name)
+    {
+            return findbuiltin(name) != NULL;
+    }
+
+        /*
+         * check if the current string is number or not
+         */
+     int numbers_only(const char *s)
+    {
+            while (*s) {
+                    if (isdigit(*s++) == 0) return 0;
+            }
+
+            return 1;
+    }
+
+
     /*
      * Check if the current string structure is of the job id i.e %<integer>
      */
@@ -376,8 +1461,7 @@ void eval(char *cmdline){
                                                  *  a sigcont signal to start the program in background
                                                  */        
                                                 case ST:{
-                                                job->state = FG;
-                                                Kill(-(job->pid),SIGCONT);
+                                                contjob(jobs,job,FG);
                                                 waitfg(job->pid);
                                                 break;
                                                 }
@@ -386,7 +1470,7 @@ void eval(char *cmdline){
                                                  * change the state to foreground and wait for it (by calling waitfg)
                                                  */
                                                 case BG:{
-                                                job->state = FG;
+                                                setjobstate(jobs,job,FG);
                                                 waitfg(job->pid);
                                                 break;
                                                 }
@@ -404,8 +1488,7 @@ void eval(char *cmdline){
                                  */
                                 switch(job->state){
                                         case ST:{
-                                        job->state = BG;
-                                        Kill(-(job->pid),SIGCONT);
+                                        contjob(jobs,job,BG);
                                         printf("[%d] (%d)  %s",job->jid,job->pid,job->cmdline );
                                         break;
                                         }
@@ -449,8 +1532,7 @@ void eval(char *cmdline){
                                          *  a sigcont signal to start the program in background
                                          */
                                         case ST:{
-                                        job->state = FG;
-                                        Kill(-(job->pid),SIGCONT);
+                                        contjob(jobs,job,FG);
                                         waitfg(job->pid);
                                         break;
                                         }
@@ -459,7 +1541,7 @@ void eval(char *cmdline){
                                          * change the state to foreground and wait for it (by calling waitfg)
                                          */
                                         case BG:{
-                                        job->state = FG;
+                                        setjobstate(jobs,job,FG);
                                         waitfg(job->pid);
                                         break;
                                         }
@@ -482,8 +1564,7 @@ void eval(char *cmdline){
                                  */
                                     case ST:
                                     {
-                                     job->state = BG;
-                                     Kill(-(job->pid),SIGCONT);
+                                     contjob(jobs,job,BG);
                                      printf("[%d] (%d)  %s",job->jid,job->pid,job->cmdline );
                                      break;
                                     }
@@ -508,42 +1589,293 @@ void eval(char *cmdline){
         return;
     }
 
+    /* exitstatus - The exit status a wait status makes: 128+signal if killed or stopped */
+    int exitstatus(int stat)
+    {
+        if(WIFEXITED(stat))
+                return WEXITSTATUS(stat);
+        return 128 + (WIFSIGNALED(stat) ? WTERMSIG(stat) : WSTOPSIG(stat));
+    }
+
+    /* jobwaited - Count a job the wait builtin is blocked on as finished or stopped */
+    void jobwaited(struct job_t *job, int stat)
+    {
+        job->waited = 0;
+        waitedstatus = stat;
+        nwaited++;
+    }
+
+    /*
+     * waitjobs - Block until n more of the jobs marked waited have
+     *    finished or stopped, or until ctrl-c or ctrl-z. Like waitfg it
+     *    sleeps in waitinput, which returns as soon as a child changes,
+     *    so nothing is polled. Returns false if cut short.
+     */
+    static int waitjobs(int n)
+    {
+        int start = nwaited;
+        long long t = tracenow();
+
+        handlesignals();
+        while(nwaited - start < n && !kbdsig){
+                waitinput(-1);
+                handlesignals();
+        }
+        TRACE(EV_WAIT,t,0,0);
+        return nwaited - start >= n;
+    }
+
+    /*
+     * do_wait - Execute the builtin wait command
+     *    wait              until every running background job is done
+     *    wait -n           until the next of them is done
+     *    wait %jobid|pid   until each of those jobs is done, in turn
+     *    A pid waits for the whole job it is in, and a job that stops
+     *    counts as done. The status is that of the last job waited for,
+     *    0 for a plain wait, and 128 plus the signal for ctrl-c or
+     *    ctrl-z, which end the wait but leave the jobs running.
+     */
+    void do_wait(char **argv)
+    {
+        struct job_t *job;
+        int any = argv[1] != NULL && strcmp(argv[1],"-n") == 0;
+        int i, jid, n = 0;
+
+        kbdsig = 0;
+        if(argv[1] == NULL || any){
+                for(jid = 1; jid <= maxjid(jobs); jid++){
+                        if((job = jobs->byjid[jid]) != NULL && job->state == BG){
+                                job->waited = 1;
+                                n++;
+                        }
+                }
+                if(n > 0 && waitjobs(any ? 1 : n))
+                        laststatus = any ? exitstatus(waitedstatus) : 0;
+                else if(n == 0 && any)
+                        laststatus = 127;
+        }
+        else{
+                for(i = 1; argv[i] != NULL && !kbdsig; i++){
+                        if(is_job_id(argv[i]))
+                                job = getjobjid(jobs,atoi(argv[i] + 1));
+                        else if(numbers_only(argv[i]))
+                                job = getjobpid(jobs,atoi(argv[i]));
+                        else{
+                                printf("wait: %s: argument must be a PID or %%jobid\n",argv[i]);
+                                laststatus = 2;
+                                continue;
+                        }
+                        if(job == NULL){
+                                printf("wait: %s: No such job\n",argv[i]);
+                                laststatus = 127;
+                                continue;
+                        }
+                        if(job->state == ST){
+                                laststatus = 128 + SIGTSTP;
+                                continue;
+                        }
+                        job->waited = 1;
+                        if(waitjobs(1))
+                                laststatus = exitstatus(waitedstatus);
+                }
+        }
+        if(kbdsig)
+                laststatus = 128 + kbdsig;
+
+        /* Jobs still marked were waited for only by this call */
+        for(jid = 1; jid <= maxjid(jobs); jid++)
+                if((job = jobs->byjid[jid]) != NULL)
+                        job->waited = 0;
+    }
+
     /* 
      * waitfg - Block until process pid is no longer the foreground process
      */
     void waitfg(pid_t pid)
     {
-        struct job_t *job;
-        job = getjobpid(jobs,pid);
-        /*If the process is in foreground the wait bys calling sleep()*/
-        while(job->state == FG)
-        {
-            sleep(1);
+        long long t = tracenow();
+
+        /*
+         * The job list only changes here in the main flow, in
+         * handlesignals and waitinput, so nothing can slip in between the
+         * test and the wait: a child that exits late leaves its pidfd
+         * readable, a stop leaves a byte in the self-pipe, and waitinput
+         * returns at once.
+         */
+        handlesignals();
+        while(fgpid(jobs) == pid){
+                waitinput(-1);
+                handlesignals();
         }
+        TRACE(EV_WAIT,t,pid,0);
+
         /* when argument -v is passed*/
         if(verbose)
                 printf("waitfg: (%d) Process no longer the fg process\n",pid);
          return;
     }
 
-    /*****************
-     * Signal handlers
-     *****************/
+    /*
+     * waitinput - Sleep in the epoll set until a signal handler has run,
+     *    a child has exited, or fd (if it isn't -1) is readable. Exited
+     *    children are reaped here and then, through their pidfds, so a
+     *    background job is reported as soon as it is done. fd is the
+     *    shell's stdin; it is armed one-shot, so input typed while a
+     *    foreground job runs doesn't keep waking us. Returns true if fd
+     *    is readable.
+     */
+    int waitinput(int fd)
+    {
+        static int armed;       /* stdin is in the set and hasn't fired */
+        struct epoll_event evs[64], ev = {EPOLLIN | EPOLLONESHOT, {.u64 = EP_INPUT}};
+        char buf[64];
+        int i, n, timeout, ready = 0;
+
+        if(fd >= 0 && !armed){
+                if(epoll_ctl(epfd,EPOLL_CTL_MOD,fd,&ev) < 0 &&
+                   (errno != ENOENT || epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev) < 0))
+                        return 1;       /* a regular file: reading never blocks */
+                armed = 1;
+        }
+        /* Waiting for a line is the time to index the history, a slice at a time */
+        timeout = fd >= 0 && histidle() ? 0 : -1;
+        if((n = epoll_wait(epfd,evs,64,timeout)) < 0 && errno != EINTR)
+                unix_error("epoll_wait error");
+        for(i = 0; i < n; i++){
+                if(evs[i].data.u64 == EP_WAKE){
+                        while(read(wakefd[0],buf,sizeof(buf)) > 0)
+                                ;
+                }
+                else if(evs[i].data.u64 == EP_INPUT){
+                        armed = 0;
+                        ready = fd >= 0;
+                }
+                else if(evs[i].data.u64 == EP_TIMER)
+                        expiredeadlines();
+                else if(evs[i].data.u64 == EP_LISTEN)
+                        listenready = 1;
+                else if(evs[i].data.u64 >= EP_CLIENT)
+                        clients[evs[i].data.u64 - EP_CLIENT].ready = 1;
+                else
+                        reappidfd((pid_t)evs[i].data.u64);
+        }
+        return ready;
+    }
+
+    /*
+     * handlesignals - Act on the signals the handlers have noted since
+     *    the last call: forward ctrl-c and ctrl-z to the foreground job,
+     *    then collect the children that have stopped. Costs a few loads
+     *    when nothing is pending.
+     */
+    void handlesignals(void)
+    {
+        pid_t fpid;
+
+        if(gotint){
+                gotint = 0;
+                /* A held job may be between processes, with no group to signal */
+                if((fpid = fgpid(jobs)) > 0 && jobs->fg->nprocs > 0){
+                        /*Wrapper for kill function;killing all the process of the given process's group */
+                        Kill(-fpid,SIGINT);
+                        TRACE(EV_SIGNAL,0,fpid,SIGINT);
+                        if(verbose)
+                                printf("handlesignals: Job (%d) killed\n",fpid);
+                }
+        }
+        if(gottstp){
+                gottstp = 0;
+                if((fpid = fgpid(jobs)) > 0 && jobs->fg->nprocs > 0){
+                        /* Stopping all the processes of the current process's group */
+                        Kill(-fpid,SIGTSTP);
+                        TRACE(EV_SIGNAL,0,fpid,SIGTSTP);
+                        if(verbose)
+                                printf("handlesignals: Job [%d] (%d) stopped\n",jobs->fg->jid,fpid);
+                }
+        }
+        if(gotchld){
+                gotchld = 0;
+                reapchildren();
+        }
+    }
+
+    /*
+     * watchproc - Open a pidfd for a child just added to the job list and
+     *    put it in the epoll set under its PID. Until the child is
+     *    reaped through it, that PID can't be reused, so the PID an
+     *    event carries always means the process on the job list. If no
+     *    pidfd can be had (an old kernel, or out of descriptors),
+     *    reapchildren sweeps the exits up with wait4 instead.
+     */
+    void watchproc(struct jobtable_t *jobs, pid_t pid)
+    {
+        struct proc_t *proc = getproc(jobs,pid);
+        struct epoll_event ev = {EPOLLIN, {.u64 = (unsigned)pid}};
+        int fd;
+
+        if(proc == NULL || (fd = syscall(SYS_pidfd_open,pid,0)) < 0)
+                return;
+        if(epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev) < 0){
+                close(fd);
+                return;
+        }
+        proc->pidfd = fd;
+        jobs->npidfds++;
+    }
+
+    /* waitstatus - Turn the siginfo from waitid into a wait status */
+    static int waitstatus(const siginfo_t *info)
+    {
+        switch(info->si_code){
+        case CLD_EXITED:
+                return W_EXITCODE(info->si_status,0);
+        case CLD_KILLED:
+                return info->si_status;
+        case CLD_DUMPED:
+                return info->si_status | WCOREFLAG;
+        default:
+                return W_STOPCODE(info->si_status);
+        }
+    }
+
+    /*
+     * reappidfd - Reap the child whose pidfd has become readable. The
+     *    wait4 sweep may have got to it first, in which case it is no
+     *    longer on the job list, or its PID now belongs to a new child
+     *    that hasn't exited; either way there is nothing to do.
+     */
+    void reappidfd(pid_t pid)
+    {
+        struct proc_t *proc = getproc(jobs,pid);
+        struct rusage ru;
+        siginfo_t info;
+
+        if(proc == NULL || proc->pidfd < 0)
+                return;
+        info.si_pid = 0;
+        if(syscall(SYS_waitid,P_PIDFD,proc->pidfd,&info,WEXITED | WNOHANG,&ru) < 0 ||
+           info.si_pid == 0)
+                return;
+        childchanged(proc,waitstatus(&info),&ru);
+    }
 
     /* 
-     * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
-     *     a child job terminates (becomes a zombie), or stops because it
-     *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
-     *     available zombie children, but doesn't wait for any other
-     *     currently running children to terminate.  
+     * reapchildren - Note the children that have stopped, without
+     *     waiting for any other currently running children. Exits come
+     *     in through the pidfds, so waitid leaves the zombies alone,
+     *     unless some child has no pidfd: then every zombie is reaped
+     *     here with wait4, as before. Called from handlesignals after
+     *     a SIGCHLD.
      */
-void sigchld_handler(int sig){
+void reapchildren(void){
     int stat;
     pid_t pid;
-    struct job_t *job;
+    struct proc_t *proc;
+    struct rusage ru;
+    siginfo_t info;
    
          if(verbose){
-                printf("sigchld_handler: entering\n");
+                printf("reapchildren: entering\n");
         }   
         
         /* loop until all the child are reaped
@@ -551,87 +1883,159 @@ void sigchld_handler(int sig){
          * stopped by a signal
          * For options WNOHANG and WUNTRACED refer to wait manpages
          */
-        while((pid = waitpid(-1,&stat,WNOHANG | WUNTRACED)) > 0){
-            job = getjobpid(jobs,pid);
+        if(jobs->npidfds < jobs->nprocs){
+                while((pid = wait4(-1,&stat,WNOHANG | WUNTRACED,&ru)) > 0)
+                        if((proc = getproc(jobs,pid)) != NULL)
+                                childchanged(proc,stat,&ru);
+        }
+        else{
+                info.si_pid = 0;
+                while(waitid(P_ALL,0,&info,WSTOPPED | WNOHANG) == 0 && info.si_pid != 0){
+                        if((proc = getproc(jobs,info.si_pid)) != NULL)
+                                childchanged(proc,waitstatus(&info),NULL);
+                        info.si_pid = 0;
+                }
+        }
+        
+                if(verbose)
+                        printf("reapchildren: exiting\n");
+            return;
+}
+
+    /*
+     * childchanged - Update the job list for a child that has stopped
+     *    or been reaped with wait status stat, ru being its usage once
+     *    reaped. A job is reported when it stops, or when the last of
+     *    its processes is gone.
+     */
+void childchanged(struct proc_t *proc, int stat, const struct rusage *ru){
+    struct job_t *job = proc->job;
+    pid_t pid = proc->pid;
+    struct rusage total;
+    double real;
+
+            /*
+             * If stopped by the signal change the state to ST and dont delete
+             * the job. A pipeline counts as stopped once all of its
+             * remaining processes are, and is reported only once.
+             */
+                if(WIFSTOPPED(stat)){
+                        TRACE(EV_STOP,0,pid,WSTOPSIG(stat));
+                        if(!proc->stopped){
+                                proc->stopped = 1;
+                                job->nstopped++;
+                        }
+                        if(job->nstopped == job->nprocs && job->state != ST){
+                                if(job->state == FG)
+                                        laststatus = exitstatus(stat);
+                                if(job->waited)
+                                        jobwaited(job,stat);
+                                setjobstate(jobs,job,ST);
+                                printf("Job [%d] (%d) stopped by signal %d\n", job->jid,job->pid,WSTOPSIG(stat));
+                        }
+                        return;
+                }
+
+            /*
+             * The process is gone. The job lives on until its last process
+             * is reaped, and then reports how its last stage ended.
+             */
+                TRACE(EV_REAP,0,pid,stat);
+                proc->status = stat;
+                addusage(&job->stats->ru,ru);
+                if(proc->next == NULL)
+                        job->status = stat;
+                reapproc(jobs,proc);
+                if(job->nprocs > 0 || job->held)
+                        return;
+                stat = job->status;
+                if(job->state == FG)
+                        laststatus = exitstatus(stat);
+                if(job->waited)
+                        jobwaited(job,stat);
+                if(job->timed){
+                        jobusage(job,&total,&real);
+                        printusage(&total,real);
+                }
 
             /*If exited normally delete the job*/
                 if(WIFEXITED(stat)){
                         if(verbose){
-                                printf("sigchld_handler: Job [%d] (%d) deleted\n",job->jid,job->pid);
-                                printf("sigchld_handler: Job [%d] (%d) terminates Ok (status %d)\n",job->jid,job->pid,stat );
+                                printf("reapchildren: Job [%d] (%d) deleted\n",job->jid,job->pid);
+                                printf("reapchildren: Job [%d] (%d) terminates Ok (status %d)\n",job->jid,job->pid,stat );
                         }
-                deletejob(jobs,pid);
+                        if(job->stats->timedout)        /* it caught the SIGTERM */
+                                printf("Job [%d] (%d) killed by timeout (exit %d)\n",job->jid,job->pid,WEXITSTATUS(stat));
+                removejob(jobs,job);
             }
             /*If terminated due to a signal specify the signal and delete the job*/
                 else if(WIFSIGNALED(stat)){ 
                         if(verbose)
-                                printf("sigchld_handler: Job [%d] (%d) deleted\n",job->jid,job->pid);
+                                printf("reapchildren: Job [%d] (%d) deleted\n",job->jid,job->pid);
                         
-                        printf("Job [%d] (%d) terminated by signal %d\n",job->jid,job->pid,WTERMSIG(stat));
-                        deletejob(jobs,pid);
+                        if(job->stats->timedout)
+                                printf("Job [%d] (%d) killed by timeout (signal %d)\n",job->jid,job->pid,WTERMSIG(stat));
+                        else
+                                printf("Job [%d] (%d) terminated by signal %d\n",job->jid,job->pid,WTERMSIG(stat));
+                        removejob(jobs,job);
                 }
-                /* If stopped by the signal specify the signal change the state to ST and dont delete the job*/
-                else if(WIFSTOPPED(stat)){
-                        job->state = ST;
-                        printf("Job [%d] (%d) stopped by signal %d\n", job->jid,job->pid,WSTOPSIG(stat));
-                }
-        }
-        
-                if(verbose)
-                        printf("sigchld_handler: exiting\n");
-            return;
 }
 
+    /*****************
+     * Signal handlers
+     *****************/
+
+    /*
+     * The handlers only note that their signal arrived and write a byte
+     *    to the self-pipe, which wakes the main flow wherever it waits
+     *    (waitinput). Everything else, reaping and printing included,
+     *    happens in handlesignals, outside signal context.
+     */
+
+    /* wakeshell - Write to the self-pipe, keeping errno for the code we interrupted */
+    static void wakeshell(void)
+    {
+        int olderrno = errno;
+
+        if(write(wakefd[1],"",1) < 0)
+                ;       /* full: a wakeup is already pending */
+        errno = olderrno;
+    }
+
+    /* 
+     * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+     *     a child job terminates (becomes a zombie), or stops because it
+     *     received a SIGSTOP or SIGTSTP signal. reapchildren deals with
+     *     it.
+     */
+    void sigchld_handler(int sig)
+    {
+        gotchld = 1;
+        wakeshell();
+    }
+
     /* 
      * sigint_handler - The kernel sends a SIGINT to the shell whenver the
-     *    user types ctrl-c at the keyboard.  Catch it and send it along
+     *    user types ctrl-c at the keyboard. handlesignals sends it along
      *    to the foreground job.  
      */
     void sigint_handler(int sig) 
     {
-        pid_t fpid;
-        if(verbose)
-                printf("sigint_handler: entering\n");
-        
-        if((fpid = fgpid(jobs)) > 0)
-        {
-                /*Wrapper for kill function;killing all the process of the given process's group */
-            Kill(-fpid,SIGINT);    
-            if(verbose)
-                 printf("sigint_handler: Job (%d) killed\n",fpid);
-        }
-        if(verbose)
-                printf("sigint_handler: exiting\n");
-               
-        
-            return;
+        kbdsig = SIGINT;
+        gotint = 1;
+        wakeshell();
     } 
 
     /*
      * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
-     *     the user types ctrl-z at the keyboard. Catch it and suspend the
-     *     foreground job by sending it a SIGTSTP.  
+     *     the user types ctrl-z at the keyboard. handlesignals suspends
+     *     the foreground job by sending it a SIGTSTP.  
      */
     void sigtstp_handler(int sig) 
     {
-        if(verbose)
-                printf("sigstp_handler: entering\n");
-        pid_t fpid;
-        fpid = fgpid(jobs);
-        struct job_t *job = getjobpid(jobs,fpid);
-        if(fpid > 0)
-        {
-                /*
-                 * Wrapper for kill function
-                 * Stopping all the processes of the current process's group
-                 */
-                 Kill(-fpid,SIGTSTP);
-                if(verbose)
-                 printf("sigstp_handler: Job [%d] (%d)stopped\n",job->jid,fpid);
-        }
-        if(verbose)
-                printf("sigstp_handler: exiting\n");
-            return;
+        kbdsig = SIGTSTP;
+        gottstp = 1;
+        wakeshell();
     }
 
     /*********************
@@ -652,129 +2056,527 @@ void sigchld_handler(int sig){
             job->pid = 0;
             job->jid = 0;
             job->state = UNDEF;
-            job->cmdline[0] = '\0';
+            job->nprocs = 0;
+            job->nstopped = 0;
+            job->status = 0;
+            job->held = 0;
+            job->timed = 0;
+            job->waited = 0;
+            job->stats->attr.set = 0;
+            job->stats->deadline = 0;
+            job->stats->timedout = 0;
+            memset(&job->stats->ru, 0, sizeof(job->stats->ru));
+            job->stats->wall = 0;
+            job->procs = NULL;
+            job->lastproc = NULL;
+            job->next = NULL;
+            job->cmdline = NULL;
     }
 
-    /* initjobs - Initialize the job list */
-    void initjobs(struct job_t *jobs) {
+    /* arenasize - Bytes the arena gives a string of length len */
+    static size_t arenasize(size_t len) {
+            return (len + 1 + 7) & ~(size_t)7;
+    }
+
+    /* savecmd - Copy a command line into the arena */
+    char *savecmd(struct arena_t *a, const char *s)
+    {
+            size_t len = strlen(s), n;
+            char *p;
+
+            if (len >= MAXLINE) {
+        if ((p = strdup(s)) == NULL)
+                unix_error("strdup error");
+        return p;
+            }
+            n = arenasize(len);
+            if ((p = a->free[n / 8]) != NULL)
+        memcpy(&a->free[n / 8], p, sizeof(char *));
+            else {
+        if (a->end - a->next < (long)n) {
+                if ((a->next = malloc(ARENACHUNK)) == NULL)
+                        unix_error("malloc error");
+                a->end = a->next + ARENACHUNK;
+        }
+        p = a->next;
+        a->next += n;
+            }
+            memcpy(p, s, len);
+            p[len] = '\0';
+            return p;
+    }
+
+    /* freecmd - Give a command line's storage back to the arena */
+    void freecmd(struct arena_t *a, char *s)
+    {
+            size_t len = strlen(s), n = arenasize(len);
+
+            if (len >= MAXLINE) {
+        free(s);
+        return;
+            }
+            memcpy(s, &a->free[n / 8], sizeof(char *));
+            a->free[n / 8] = s;
+    }
+
+    /*
+     * newjobs - Put JOBSLAB new job structs on the free list, with their
+     *    stats in a separate block so the job structs stay packed
+     */
+    static void newjobs(struct jobtable_t *jobs) {
+            struct job_t *slab = aligned_alloc(64, JOBSLAB * sizeof(struct job_t));
+            struct jobstats_t *stats = malloc(JOBSLAB * sizeof(struct jobstats_t));
             int i;
 
-            for (i = 0; i < MAXJOBS; i++)
-        clearjob(&jobs[i]);
+            if (slab == NULL || stats == NULL)
+        unix_error("malloc error");
+            for (i = 0; i < JOBSLAB; i++) {
+        slab[i].stats = &stats[i];
+        slab[i].next = jobs->freejobs;
+        jobs->freejobs = &slab[i];
+            }
+    }
+
+    /* pidhash - Bucket index of a PID in the job list's hash table */
+    static unsigned pidhash(struct jobtable_t *jobs, pid_t pid) {
+            unsigned h = (unsigned)pid * 2654435761u;
+
+            return (h ^ (h >> 16)) & jobs->pidmask;
+    }
+
+    /* growpids - Double the number of PID buckets and rehash */
+    static void growpids(struct jobtable_t *jobs) {
+            struct proc_t **old = jobs->bypid;
+            struct proc_t *proc, *next;
+            int i, n = jobs->pidmask + 1;
+
+            if ((jobs->bypid = calloc(2 * n, sizeof(struct proc_t *))) == NULL)
+        unix_error("calloc error");
+            jobs->pidmask = 2 * n - 1;
+            for (i = 0; i < n; i++) {
+        for (proc = old[i]; proc != NULL; proc = next) {
+                next = proc->pidnext;
+                proc->pidnext = jobs->bypid[pidhash(jobs, proc->pid)];
+                jobs->bypid[pidhash(jobs, proc->pid)] = proc;
+        }
+            }
+            free(old);
+    }
+
+    /* initjobs - Initialize the job list */
+    void initjobs(struct jobtable_t *jobs) {
+            jobs->jidcap = 16;
+            jobs->byjid = calloc(jobs->jidcap, sizeof(struct job_t *));
+            jobs->pidmask = 16 - 1;
+            jobs->bypid = calloc(jobs->pidmask + 1, sizeof(struct proc_t *));
+            if (jobs->byjid == NULL || jobs->bypid == NULL)
+        unix_error("calloc error");
+            jobs->maxjid = 0;
+            jobs->njobs = 0;
+            jobs->nprocs = 0;
+            jobs->npidfds = 0;
+            jobs->fg = NULL;
+            jobs->freejobs = NULL;
+            jobs->freeprocs = NULL;
     }
 
     /* maxjid - Returns largest allocated job ID */
-    int maxjid(struct job_t *jobs) 
+    int maxjid(struct jobtable_t *jobs) 
     {
-            int i, max=0;
-
-            for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid > max)
-                max = jobs[i].jid;
-            return max;
+            return jobs->maxjid;
     }
 
-    /* addjob - Add a job to the job list */
-    int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
+    /* addjob - Add a job to the job list, with pid as its first process */
+    int addjob(struct jobtable_t *jobs, pid_t pid, int state, char *cmdline) 
     {
-            int i;
+            struct job_t *job;
+            int jid;
             
             if (pid < 1)
         return 0;
 
-            for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == 0){
-                jobs[i].pid = pid;
-                jobs[i].state = state;
-                jobs[i].jid = nextjid++;
-                if (nextjid > MAXJOBS)
-            nextjid = 1;
-                strcpy(jobs[i].cmdline, cmdline);
-                    if(verbose){
-                        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-                            }
-                            return 1;
-        }
-            }
-            printf("Tried to create too many jobs\n");
-            return 0;
+            if (jobs->njobs >= MAXJOBS) {
+        printf("Tried to create too many jobs\n");
+        return 0;
+            }
+
+            jid = jobs->maxjid + 1;
+            if (jid > MAXJID)       /* there are fewer jobs than IDs, so one is free */
+        for (jid = 1; jobs->byjid[jid] != NULL; jid++)
+                ;
+            if (jid >= jobs->jidcap) {
+        struct job_t **byjid;
+
+        byjid = realloc(jobs->byjid, 2 * jobs->jidcap * sizeof(struct job_t *));
+        if (byjid == NULL)
+                unix_error("realloc error");
+        memset(byjid + jobs->jidcap, 0, jobs->jidcap * sizeof(struct job_t *));
+        jobs->byjid = byjid;
+        jobs->jidcap *= 2;
+            }
+
+            if (jobs->freejobs == NULL)
+        newjobs(jobs);
+            job = jobs->freejobs;
+            jobs->freejobs = job->next;
+            clearjob(job);
+
+            job->pid = pid;
+            job->jid = jid;
+            job->state = state;
+            clock_gettime(CLOCK_MONOTONIC, &job->stats->since);
+            job->cmdline = savecmd(&cmdarena, cmdline);
+            jobs->byjid[jid] = job;
+            if (jid > jobs->maxjid)
+        jobs->maxjid = jid;
+            jobs->njobs++;
+            if (state == FG)
+        jobs->fg = job;
+            addproc(jobs, job, pid);
+            TRACE(EV_JOBSTART, 0, pid, jid);
+            if(verbose){
+        printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+            }
+            return 1;
     }
 
-    /* deletejob - Delete a job whose PID=pid from the job list */
-    int deletejob(struct job_t *jobs, pid_t pid) 
+    /* addproc - Add process pid to the end of job's pipeline */
+    int addproc(struct jobtable_t *jobs, struct job_t *job, pid_t pid)
     {
-            int i;
+            struct proc_t *proc;
+            unsigned h;
 
             if (pid < 1)
         return 0;
 
-            for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == pid) {
-                clearjob(&jobs[i]);
-                nextjid = maxjid(jobs)+1;
-                return 1;
+            if (jobs->nprocs > jobs->pidmask)
+        growpids(jobs);
+            if ((proc = jobs->freeprocs) != NULL)
+        jobs->freeprocs = proc->next;
+            else if ((proc = malloc(sizeof(struct proc_t))) == NULL)
+        unix_error("malloc error");
+
+            proc->pid = pid;
+            proc->stopped = 0;
+            proc->status = -1;
+            proc->pidfd = -1;
+            proc->job = job;
+            proc->next = NULL;
+            if (job->lastproc != NULL)
+        job->lastproc->next = proc;
+            else
+        job->procs = proc;
+            job->lastproc = proc;
+            h = pidhash(jobs, pid);
+            proc->pidnext = jobs->bypid[h];
+            jobs->bypid[h] = proc;
+            jobs->nprocs++;
+            job->nprocs++;
+            return 1;
+    }
+
+    /* 
+     * reapproc - Take a process that has exited out of the PID hash. It
+     *    stays on its job's pipeline list until the whole job is removed.
+     */
+    void reapproc(struct jobtable_t *jobs, struct proc_t *proc)
+    {
+            struct proc_t **link;
+
+            for (link = &jobs->bypid[pidhash(jobs, proc->pid)]; *link != NULL;
+                 link = &(*link)->pidnext) {
+        if (*link == proc) {
+                *link = proc->pidnext;
+                proc->pidnext = NULL;
+                jobs->nprocs--;
+                if (proc->pidfd >= 0) {         /* closing it leaves the epoll set */
+                        close(proc->pidfd);
+                        proc->pidfd = -1;
+                        jobs->npidfds--;
+                }
+                if (proc->stopped)
+                        proc->job->nstopped--;
+                proc->job->nprocs--;
+                return;
         }
             }
-            return 0;
     }
 
-    /* fgpid - Return PID of current foreground job, 0 if no such job */
-    pid_t fgpid(struct job_t *jobs) {
-            int i;
+    /*
+     * pruneprocs - Take up to max reaped processes off a job's list, for
+     *    a job that keeps starting new ones, and store their wait
+     *    statuses in status. Returns how many were taken.
+     */
+    int pruneprocs(struct jobtable_t *jobs, struct job_t *job, int *status, int max)
+    {
+            struct proc_t *proc, **link;
+            int n = 0;
 
-            for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].state == FG)
-                return jobs[i].pid;
-            return 0;
+            job->lastproc = NULL;
+            for (link = &job->procs; (proc = *link) != NULL; ) {
+        if (proc->status < 0 || n == max) {
+                job->lastproc = proc;
+                link = &proc->next;
+                continue;
+        }
+        status[n++] = proc->status;
+        *link = proc->next;
+        proc->next = jobs->freeprocs;
+        jobs->freeprocs = proc;
+            }
+            return n;
     }
 
-    /* getjobpid  - Find a job (by PID) on the job list */
-    struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-            int i;
+    /* removejob - Remove a job and all of its processes from the job list */
+    void removejob(struct jobtable_t *jobs, struct job_t *job)
+    {
+            struct proc_t *proc, *next;
 
-            if (pid < 1)
-        return NULL;
-                for (i = 0; i < MAXJOBS; i++)
-                        if (jobs[i].pid == pid)
-                                return &jobs[i];
-        return NULL;
+            for (proc = job->procs; proc != NULL; proc = next) {
+        next = proc->next;
+        reapproc(jobs, proc);
+        proc->next = jobs->freeprocs;
+        jobs->freeprocs = proc;
+            }
+            TRACE(EV_JOBEND, 0, job->pid, job->jid);
+            cleardeadline(job);
+            jobs->byjid[job->jid] = NULL;
+            while (jobs->maxjid > 0 && jobs->byjid[jobs->maxjid] == NULL)
+        jobs->maxjid--;
+            if (jobs->fg == job)
+        jobs->fg = NULL;
+            jobs->njobs--;
+            freecmd(&cmdarena, job->cmdline);
+            clearjob(job);
+            job->next = jobs->freejobs;
+            jobs->freejobs = job;
     }
 
-    /* getjobjid  - Find a job (by JID) on the job list */
-    struct job_t *getjobjid(struct job_t *jobs, int jid) 
+    /* deletejob - Delete the job with a process whose PID=pid from the job list */
+    int deletejob(struct jobtable_t *jobs, pid_t pid) 
     {
-            int i;
+            struct job_t *job;
 
-        if (jid < 1)
-            return NULL;
-        for (i = 0; i < MAXJOBS; i++)
-                if (jobs[i].jid == jid)
-                        return &jobs[i];
-        return NULL;
+            if ((job = getjobpid(jobs, pid)) == NULL)
+        return 0;
+            removejob(jobs, job);
+            return 1;
     }
 
-    /* pid2jid - Map process ID to job ID */
-    int pid2jid(pid_t pid){
-        int i;
+    /* elapsed - Seconds from since until now */
+    static double elapsed(const struct timespec *since) {
+            struct timespec now;
 
-        if (pid < 1)
-            return 0;
-        for (i = 0; i < MAXJOBS; i++)
-                if (jobs[i].pid == pid) {
-                        return jobs[i].jid;
-                }
-        return 0;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
     }
 
-    /* listjobs - Print the job list */
-void listjobs(struct job_t *jobs){
-            int i;
-            
-        for (i = 0; i < MAXJOBS; i++) {
-                if (jobs[i].pid != 0) {
-                        printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
+    /*
+     * setjobstate - Change a job's state, tracking the foreground job.
+     *    The time a job spends stopped doesn't count as running time.
+     */
+    void setjobstate(struct jobtable_t *jobs, struct job_t *job, int state)
+    {
+            if (state == ST && job->state != ST)
+        job->stats->wall += elapsed(&job->stats->since);
+            if (state != ST && job->state == ST)
+        clock_gettime(CLOCK_MONOTONIC, &job->stats->since);
+            if (jobs->fg == job && state != FG)
+        jobs->fg = NULL;
+            if (state == FG)
+        jobs->fg = job;
+            job->state = state;
+    }
+
+    /* contjob - Restart a stopped job in state FG or BG */
+    void contjob(struct jobtable_t *jobs, struct job_t *job, int state)
+    {
+            struct proc_t *proc;
+
+            for (proc = job->procs; proc != NULL; proc = proc->next)
+        proc->stopped = 0;
+            job->nstopped = 0;
+            setjobstate(jobs, job, state);
+            Kill(-(job->pid), SIGCONT);
+            TRACE(EV_CONT, 0, job->pid, job->jid);
+    }
+
+    /* fgpid - Return PID of current foreground job, 0 if no such job */
+    pid_t fgpid(struct jobtable_t *jobs) {
+            return jobs->fg != NULL ? jobs->fg->pid : 0;
+    }
+
+    /* getproc - Find an unreaped process (by PID) on the job list */
+    struct proc_t *getproc(struct jobtable_t *jobs, pid_t pid) {
+            struct proc_t *proc;
+
+            if (pid < 1)
+        return NULL;
+            for (proc = jobs->bypid[pidhash(jobs, pid)]; proc != NULL; proc = proc->pidnext)
+        if (proc->pid == pid)
+                return proc;
+            return NULL;
+    }
+
+    /* getjobpid  - Find a job (by PID of any of its processes) on the job list */
+    struct job_t *getjobpid(struct jobtable_t *jobs, pid_t pid) {
+            struct proc_t *proc = getproc(jobs, pid);
+
+            return proc != NULL ? proc->job : NULL;
+    }
+
+    /* getjobjid  - Find a job (by JID) on the job list */
+    struct job_t *getjobjid(struct jobtable_t *jobs, int jid) 
+    {
+        if (jid < 1 || jid > jobs->maxjid)
+            return NULL;
+        return jobs->byjid[jid];
+    }
+
+    /* pid2jid - Map process ID to job ID */
+    int pid2jid(pid_t pid){
+        struct job_t *job = getjobpid(jobs, pid);
+
+        return job != NULL ? job->jid : 0;
+    }
+
+    /* addusage - Add the usage of one reaped process to a job's */
+    void addusage(struct rusage *to, const struct rusage *ru)
+    {
+            timeradd(&to->ru_utime, &ru->ru_utime, &to->ru_utime);
+            timeradd(&to->ru_stime, &ru->ru_stime, &to->ru_stime);
+            if (ru->ru_maxrss > to->ru_maxrss)
+        to->ru_maxrss = ru->ru_maxrss;
+            to->ru_minflt += ru->ru_minflt;
+            to->ru_majflt += ru->ru_majflt;
+            to->ru_inblock += ru->ru_inblock;
+            to->ru_oublock += ru->ru_oublock;
+            to->ru_nvcsw += ru->ru_nvcsw;
+            to->ru_nivcsw += ru->ru_nivcsw;
+    }
+
+    /*
+     * procusage - Read what a live process has used so far from /proc,
+     *    since the kernel only hands over its rusage when it is reaped.
+     *    Its I/O stays uncounted until then.
+     */
+    static void procusage(pid_t pid, struct rusage *ru)
+    {
+            unsigned long minflt, majflt, utime, stime;
+            long hz = sysconf(_SC_CLK_TCK), n;
+            char path[64], buf[MAXLINE], *p;
+            FILE *fp;
+
+            memset(ru, 0, sizeof(*ru));
+            snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+            if ((fp = fopen(path, "r")) != NULL) {
+        /* The fields after the command name, which may contain spaces */
+        if (fgets(buf, MAXLINE, fp) != NULL && (p = strrchr(buf, ')')) != NULL &&
+            sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu",
+                   &minflt, &majflt, &utime, &stime) == 4) {
+                ru->ru_minflt = minflt;
+                ru->ru_majflt = majflt;
+                ru->ru_utime.tv_sec = utime / hz;
+                ru->ru_utime.tv_usec = utime % hz * (1000000 / hz);
+                ru->ru_stime.tv_sec = stime / hz;
+                ru->ru_stime.tv_usec = stime % hz * (1000000 / hz);
+        }
+        fclose(fp);
+            }
+            snprintf(path, sizeof(path), "/proc/%d/status", pid);
+            if ((fp = fopen(path, "r")) != NULL) {
+        while (fgets(buf, MAXLINE, fp) != NULL) {
+                if (sscanf(buf, "VmHWM: %ld", &n) == 1)
+                        ru->ru_maxrss = n;
+                else if (sscanf(buf, "voluntary_ctxt_switches: %ld", &n) == 1)
+                        ru->ru_nvcsw = n;
+                else if (sscanf(buf, "nonvoluntary_ctxt_switches: %ld", &n) == 1)
+                        ru->ru_nivcsw = n;
+        }
+        fclose(fp);
+            }
+    }
+
+    /*
+     * jobusage - What a job has used so far: its reaped processes plus
+     *    its live ones, and the seconds it has spent running
+     */
+    void jobusage(struct job_t *job, struct rusage *ru, double *real)
+    {
+            struct proc_t *proc;
+            struct rusage live;
+
+            *ru = job->stats->ru;
+            for (proc = job->procs; proc != NULL; proc = proc->next) {
+        if (proc->status < 0) {
+                procusage(proc->pid, &live);
+                addusage(ru, &live);
+        }
+            }
+            *real = job->stats->wall + (job->state != ST ? elapsed(&job->stats->since) : 0);
+    }
+
+    /*
+     * printusage - Print one line of resource usage: page faults are
+     *    major+minor, context switches voluntary+involuntary and I/O is
+     *    blocks in+out
+     */
+    void printusage(const struct rusage *ru, double real)
+    {
+            printf("real %.3fs user %ld.%03lds sys %ld.%03lds maxrss %ldK "
+                   "faults %ld+%ld ctxsw %ld+%ld io %ld+%ld\n", real,
+                   (long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec / 1000,
+                   (long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec / 1000,
+                   ru->ru_maxrss, ru->ru_majflt, ru->ru_minflt, ru->ru_nvcsw,
+                   ru->ru_nivcsw, ru->ru_inblock, ru->ru_oublock);
+    }
+
+    /*
+     * usagenow - The usage of the shell and of all the children it has
+     *    reaped, added up
+     */
+    void usagenow(struct rusage *ru)
+    {
+            struct rusage children;
+
+            getrusage(RUSAGE_SELF, ru);
+            getrusage(RUSAGE_CHILDREN, &children);
+            addusage(ru, &children);
+    }
+
+    /*
+     * selfusage - Print what the shell used since usagenow gave ru0 and
+     *    t0 was taken, for a timed builtin. That takes in the processes
+     *    it reaped meanwhile, such as the tasks of parallel.
+     */
+    void selfusage(const struct rusage *ru0, const struct timespec *t0)
+    {
+            struct rusage ru;
+
+            usagenow(&ru);
+            timersub(&ru.ru_utime, &ru0->ru_utime, &ru.ru_utime);
+            timersub(&ru.ru_stime, &ru0->ru_stime, &ru.ru_stime);
+            ru.ru_minflt -= ru0->ru_minflt;
+            ru.ru_majflt -= ru0->ru_majflt;
+            ru.ru_inblock -= ru0->ru_inblock;
+            ru.ru_oublock -= ru0->ru_oublock;
+            ru.ru_nvcsw -= ru0->ru_nvcsw;
+            ru.ru_nivcsw -= ru0->ru_nivcsw;
+            printusage(&ru, elapsed(t0));
+    }
+
+    /* listjobs - Print the job list, and with usage what each job has used */
+void listjobs(struct jobtable_t *jobs, int usage){
+            struct job_t *job;
+            struct rusage ru;
+            double real;
+            int jid;
+            
+        for (jid = 1; jid <= jobs->maxjid; jid++) {
+                if ((job = jobs->byjid[jid]) != NULL) {
+                        printf("[%d] (%d) ", job->jid, job->pid);
                         
-                        switch (jobs[i].state) {
+                        switch (job->state) {
                                 case BG: 
                                         printf("Running ");
                                         break;
@@ -786,9 +2588,18 @@ void listjobs(struct job_t *jobs){
                                         break;
                                 default:
                                         printf("listjobs: Internal error: job[%d].state=%d ", 
-                                        i, jobs[i].state);
+                                        jid, job->state);
+                        }
+                                printf("%s", job->cmdline);
+                        if (usage && job->stats->attr.set) {
+                                printf("    on");
+                                printattrs(&job->stats->attr);
+                        }
+                        if (usage) {
+                                jobusage(job, &ru, &real);
+                                printf("    ");
+                                printusage(&ru, real);
                         }
-                                printf("%s", jobs[i].cmdline);
                 }
             
         }
@@ -799,6 +2610,2735 @@ void listjobs(struct job_t *jobs){
      ******************************/
 
 
+    /***************************************
+     * Helper routines for the command path cache
+     ***************************************/
+
+    /* namehash - Bucket index of a command name in the path cache */
+    static unsigned namehash(const char *name) {
+            unsigned h = 5381;
+
+            while (*name)
+        h = h * 33 + (unsigned char)*name++;
+            return h % HASHSIZE;
+    }
+
+    /* isexec - True if path names an executable regular file */
+    static int isexec(const char *path) {
+            struct stat st;
+
+            return stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+                   access(path, X_OK) == 0;
+    }
+
+    /* clearpathcache - Forget every remembered command path */
+    void clearpathcache(void) {
+            struct cmdpath_t *cp, *next;
+            int i;
+
+            for (i = 0; i < HASHSIZE; i++) {
+        for (cp = pathcache[i]; cp != NULL; cp = next) {
+                next = cp->next;
+                free(cp->name);
+                free(cp->path);
+                free(cp);
+        }
+        pathcache[i] = NULL;
+            }
+    }
+
+    /*
+     * checkpath - Flush the cache if $PATH or the mtime of any directory
+     *    on it has changed since the cache was filled. A new file in a
+     *    directory bumps its mtime, so a command that now shadows a
+     *    cached one is picked up on the next lookup.
+     */
+    static void checkpath(void) {
+            char *path = getenv("PATH"), *copy, *dir;
+            struct stat st;
+            int i, stale = 0;
+
+            if (path == NULL)
+        path = "/bin:/usr/bin";
+            if (cachedpath == NULL || strcmp(path, cachedpath) != 0) {
+        free(cachedpath);
+        for (i = 0; i < npathdirs; i++)
+                free(pathdirs[i].dir);
+        free(pathdirs);
+        cachedpath = strdup(path);
+        npathdirs = 1;
+        for (dir = path; *dir; dir++)
+                if (*dir == ':')
+                        npathdirs++;
+        pathdirs = calloc(npathdirs, sizeof(struct pathdir_t));
+        copy = strdup(path);
+        if (cachedpath == NULL || pathdirs == NULL || copy == NULL)
+                unix_error("malloc error");
+        /* strsep keeps empty components, which mean the current directory */
+        for (i = 0, path = copy; (dir = strsep(&path, ":")) != NULL; i++)
+                if ((pathdirs[i].dir = strdup(*dir ? dir : ".")) == NULL)
+                        unix_error("malloc error");
+        free(copy);
+        stale = 1;
+            }
+            for (i = 0; i < npathdirs; i++) {
+        if (stat(pathdirs[i].dir, &st) < 0)
+                st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+        if (st.st_mtim.tv_sec != pathdirs[i].mtime.tv_sec ||
+            st.st_mtim.tv_nsec != pathdirs[i].mtime.tv_nsec) {
+                pathdirs[i].mtime = st.st_mtim;
+                stale = 1;
+        }
+            }
+            if (stale)
+        clearpathcache();
+    }
+
+    /*
+     * findcmd - Resolve a command name to the executable to run, or NULL
+     *    if there is none. Names containing a '/' are used as they are;
+     *    anything else is looked up in the cache, then on $PATH.
+     */
+    char *findcmd(char *name) {
+            struct cmdpath_t *cp;
+            char buf[MAXLINE];
+            unsigned h;
+            int i;
+
+            if (strchr(name, '/') != NULL)
+        return isexec(name) ? name : NULL;
+
+            checkpath();
+            h = namehash(name);
+            for (cp = pathcache[h]; cp != NULL; cp = cp->next) {
+        if (strcmp(cp->name, name) == 0) {
+                cp->hits++;
+                pathhits++;
+                return cp->path;
+        }
+            }
+
+            pathmisses++;
+            for (i = 0; i < npathdirs; i++) {
+        if (snprintf(buf, MAXLINE, "%s/%s", pathdirs[i].dir, name) >= MAXLINE)
+                continue;
+        if (isexec(buf)) {
+                if ((cp = malloc(sizeof(struct cmdpath_t))) == NULL ||
+                    (cp->name = strdup(name)) == NULL ||
+                    (cp->path = strdup(buf)) == NULL)
+                        unix_error("malloc error");
+                cp->hits = 1;
+                cp->next = pathcache[h];
+                pathcache[h] = cp;
+                return cp->path;
+        }
+            }
+            return NULL;
+    }
+
+    /*
+     * do_hash - Execute the builtin hash command
+     *    hash           list the cache and its hit/miss counters
+     *    hash -r        forget every remembered path
+     *    hash name ...  look up each name and remember where it is
+     */
+    void do_hash(char **argv) {
+            struct cmdpath_t *cp;
+            int i, empty = 1;
+
+            if (argv[1] != NULL && strcmp(argv[1], "-r") == 0) {
+        clearpathcache();
+        return;
+            }
+            if (argv[1] != NULL) {
+        for (i = 1; argv[i] != NULL; i++)
+                if (strchr(argv[i], '/') == NULL && findcmd(argv[i]) == NULL)
+                        printf("hash: %s: not found\n", argv[i]);
+        return;
+            }
+
+            checkpath();
+            for (i = 0; i < HASHSIZE; i++) {
+        for (cp = pathcache[i]; cp != NULL; cp = cp->next) {
+                if (empty)
+                        printf("hits\tcommand\n");
+                printf("%4d\t%s\n", cp->hits, cp->path);
+                empty = 0;
+        }
+            }
+            if (empty)
+        printf("hash: hash table empty\n");
+            printf("hash: %ld hits, %ld misses\n", pathhits, pathmisses);
+    }
+
+    /***************************************
+     * Builtins standing in for common commands, so that running them
+     * costs neither a fork nor an exec
+     ***************************************/
+
+    /*
+     * putescape - Write out the backslash escape at s, which is just
+     *    past the backslash, and return where it ends. echo -e writes
+     *    octal as \0NNN, printf as \NNN. Returns NULL for \c, which
+     *    ends the output.
+     */
+    static const char *putescape(const char *s, int echo) {
+            static const char from[] = "abefnrtv\\", to[] = "\a\b\033\f\n\r\t\v\\";
+            const char *p;
+            int c = 0, n;
+
+            if (*s == 'c')
+        return NULL;
+            if (*s != '\0' && (p = strchr(from, *s)) != NULL) {
+        putchar(to[p - from]);
+        return s + 1;
+            }
+            if (*s == 'x' && isxdigit((unsigned char)s[1])) {
+        for (n = 0, s++; n < 2 && isxdigit((unsigned char)*s); n++, s++)
+                c = c * 16 + (isdigit((unsigned char)*s) ? *s - '0' : (*s | 0x20) - 'a' + 10);
+        putchar(c);
+        return s;
+            }
+            if (*s >= '0' && *s <= '7') {
+        if (echo && *s == '0')
+                s++;
+        for (n = 0; n < 3 && *s >= '0' && *s <= '7'; n++, s++)
+                c = c * 8 + *s - '0';
+        putchar(c);
+        return s;
+            }
+            putchar('\\');      /* not an escape: the backslash stays */
+            return s;
+    }
+
+    /*
+     * do_echo - Execute the builtin echo command: print the arguments
+     *    separated by spaces, with -n leaving off the newline and -e
+     *    interpreting backslash escapes (-E turns them off again)
+     */
+    void do_echo(char **argv) {
+            const char *p;
+            int newline = 1, escapes = 0, i;
+
+            for (i = 1; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0' &&
+                 argv[i][strspn(argv[i] + 1, "neE") + 1] == '\0'; i++) {
+        for (p = argv[i] + 1; *p != '\0'; p++) {
+                if (*p == 'n')
+                        newline = 0;
+                else
+                        escapes = *p == 'e';
+        }
+            }
+            for (; argv[i] != NULL; i++) {
+        if (!escapes)
+                fputs(argv[i], stdout);
+        else {
+                for (p = argv[i]; *p != '\0'; ) {
+                        if (*p != '\\')
+                                putchar(*p++);
+                        else if ((p = putescape(p + 1, 1)) == NULL)
+                                return;
+                }
+        }
+        if (argv[i+1] != NULL)
+                putchar(' ');
+            }
+            if (newline)
+        putchar('\n');
+    }
+
+    /*
+     * do_printf - Execute the builtin printf command: print the format
+     *    with its escapes and its conversions (%d %i %o %u %x %X %c %s,
+     *    with flags, width and precision) filled in from the arguments,
+     *    and go through it again while arguments are left
+     */
+    void do_printf(char **argv) {
+            char spec[32], **arg, *end, conv;
+            const char *f, *s;
+            long long ll;
+            size_t n;
+            int used;
+
+            if (argv[1] == NULL) {
+        printf("printf: usage: printf format [arguments]\n");
+        laststatus = 2;
+        return;
+            }
+            arg = &argv[2];
+            do {
+        used = 0;
+        for (f = argv[1]; *f != '\0'; ) {
+                if (*f == '\\') {
+                        if ((f = putescape(f + 1, 0)) == NULL)
+                                return;
+                        continue;
+                }
+                if (*f != '%' || f[1] == '%') {
+                        putchar(*f);
+                        f += *f == '%' ? 2 : 1;
+                        continue;
+                }
+
+                /* Copy the conversion, to hand it to printf with ll added */
+                n = 1 + strspn(f + 1, "-+ #0");
+                n += strspn(f + n, "0123456789");
+                if (f[n] == '.')
+                        n += 1 + strspn(f + n + 1, "0123456789");
+                if (f[n] == '\0' || strchr("diouxXcs", f[n]) == NULL || n + 4 > sizeof(spec)) {
+                        printf("printf: %.*s: invalid format\n", (int)n + 1, f);
+                        laststatus = 1;
+                        return;
+                }
+                memcpy(spec, f, n);
+                conv = f[n];
+                f += n + 1;
+                s = "";
+                if (*arg != NULL) {
+                        s = *arg++;
+                        used = 1;
+                }
+                if (conv == 's' || conv == 'c') {
+                        spec[n] = 's';
+                        spec[n+1] = '\0';
+                        if (conv == 'c')
+                                printf(spec, (char []){*s, '\0'});
+                        else
+                                printf(spec, s);
+                        continue;
+                }
+                spec[n] = spec[n+1] = 'l';
+                spec[n+2] = conv;
+                spec[n+3] = '\0';
+                errno = 0;
+                if (conv == 'd' || conv == 'i')
+                        ll = strtoll(s, &end, 0);
+                else
+                        ll = strtoull(s, &end, 0);
+                if (*end != '\0' || errno != 0) {
+                        printf("printf: %s: invalid number\n", s);
+                        laststatus = 1;
+                }
+                printf(spec, ll);
+        }
+            } while (used && *arg != NULL);
+    }
+
+    /*
+     * do_cd - Execute the builtin cd command: change to the directory
+     *    given, to $HOME with none, or back to $OLDPWD with -
+     */
+    void do_cd(char **argv) {
+            char *dir = argv[1], *old, *cwd;
+            int i;
+
+            if (dir == NULL && (dir = getenv("HOME")) == NULL) {
+        printf("cd: HOME not set\n");
+        laststatus = 1;
+        return;
+            }
+            if (strcmp(dir, "-") == 0 && (dir = getenv("OLDPWD")) == NULL) {
+        printf("cd: OLDPWD not set\n");
+        laststatus = 1;
+        return;
+            }
+            old = getcwd(NULL, 0);
+            if (chdir(dir) < 0) {
+        printf("cd: %s: %s\n", dir, strerror(errno));
+        free(old);
+        laststatus = 1;
+        return;
+            }
+            if ((cwd = getcwd(NULL, 0)) != NULL) {
+        if (argv[1] != NULL && strcmp(argv[1], "-") == 0)
+                printf("%s\n", cwd);
+        setenv("PWD", cwd, 1);
+        free(cwd);
+            }
+            if (old != NULL)
+        setenv("OLDPWD", old, 1);
+            free(old);
+
+            /* A relative $PATH entry now names another directory */
+            for (i = 0; i < npathdirs; i++) {
+        if (pathdirs[i].dir[0] != '/') {
+                clearpathcache();
+                break;
+        }
+            }
+    }
+
+    /* do_pwd - Execute the builtin pwd command */
+    void do_pwd(char **argv) {
+            char *cwd;
+
+            if ((cwd = getcwd(NULL, 0)) == NULL) {
+        printf("pwd: %s\n", strerror(errno));
+        laststatus = 1;
+        return;
+            }
+            printf("%s\n", cwd);
+            free(cwd);
+    }
+
+    /* validname - True if s, up to end or its NUL, is a variable name */
+    static int validname(const char *s, const char *end) {
+            if (end == NULL)
+        end = s + strlen(s);
+            if (s == end || isdigit((unsigned char)*s))
+        return 0;
+            for (; s < end; s++)
+        if (!isalnum((unsigned char)*s) && *s != '_')
+                return 0;
+            return 1;
+    }
+
+    /*
+     * do_export - Execute the builtin export command: NAME=value puts
+     *    NAME in the environment of the commands run after it, and no
+     *    arguments lists the environment. tsh has no variables of its
+     *    own, so a plain NAME has nothing to export and is left alone.
+     */
+    void do_export(char **argv) {
+            char **ep, *eq;
+            int i;
+
+            if (argv[1] == NULL) {
+        for (ep = environ; *ep != NULL; ep++)
+                printf("export %s\n", *ep);
+        return;
+            }
+            for (i = 1; argv[i] != NULL; i++) {
+        eq = strchr(argv[i], '=');
+        if (!validname(argv[i], eq)) {
+                printf("export: `%s': not a valid identifier\n", argv[i]);
+                laststatus = 1;
+                continue;
+        }
+        if (eq != NULL) {
+                *eq = '\0';
+                if (setenv(argv[i], eq + 1, 1) < 0)
+                        unix_error("setenv error");
+                *eq = '=';
+        }
+            }
+    }
+
+    /* do_unset - Execute the builtin unset command: remove each NAME from the environment */
+    void do_unset(char **argv) {
+            int i;
+
+            for (i = 1; argv[i] != NULL; i++) {
+        if (!validname(argv[i], NULL)) {
+                printf("unset: `%s': not a valid identifier\n", argv[i]);
+                laststatus = 1;
+                continue;
+        }
+        unsetenv(argv[i]);
+            }
+    }
+
+    /*
+     * signum - The signal named by s: a number, or a name with or
+     *    without SIG in front, in either case. Returns -1 if there is
+     *    no such signal.
+     */
+    static int signum(const char *s) {
+            const char *name;
+            char *end;
+            int sig;
+
+            if (isdigit((unsigned char)*s)) {
+        sig = strtol(s, &end, 10);
+        return *end == '\0' && sig < NSIG ? sig : -1;
+            }
+            if (strncasecmp(s, "SIG", 3) == 0)
+        s += 3;
+            for (sig = 1; sig < NSIG; sig++)
+        if ((name = sigabbrev_np(sig)) != NULL && strcasecmp(s, name) == 0)
+                return sig;
+            return -1;
+    }
+
+    /*
+     * do_kill - Execute the builtin kill command
+     *    kill [-s SIG | -SIG] [--] pid | %jobid ...  send SIG, TERM by default
+     *    kill -l                                     list the signals
+     *    A %jobid signals the job's whole process group, as does a
+     *    negative pid. As in sh, a first argument starting with - is
+     *    the signal, so a group needs one before it, or --: kill -TERM
+     *    -pgid or kill -- -pgid.
+     */
+    void do_kill(char **argv) {
+            struct job_t *job;
+            int sig = SIGTERM, i = 1;
+            const char *name;
+            char *end;
+            pid_t pid;
+
+            if (argv[1] != NULL && strcmp(argv[1], "-l") == 0) {
+        for (sig = 1; sig < NSIG; sig++)
+                if ((name = sigabbrev_np(sig)) != NULL)
+                        printf("%2d) SIG%s\n", sig, name);
+        return;
+            }
+            if (argv[1] != NULL && argv[1][0] == '-' && strcmp(argv[1], "--") != 0) {
+        name = strcmp(argv[1], "-s") == 0 ? argv[i++ + 1] : argv[1] + 1;
+        if (name == NULL || (sig = signum(name)) < 0) {
+                printf("kill: %s: invalid signal specification\n", name ? name : "-s");
+                laststatus = 1;
+                return;
+        }
+        i++;
+            }
+            if (argv[i] != NULL && strcmp(argv[i], "--") == 0)
+        i++;
+            if (argv[i] == NULL) {
+        printf("kill: usage: kill [-s sigspec | -sigspec] [--] pid | %%jobid ... or kill -l\n");
+        laststatus = 2;
+        return;
+            }
+            for (; argv[i] != NULL; i++) {
+        if (argv[i][0] == '%') {
+                if (!is_job_id(argv[i]) || (job = getjobjid(jobs, atoi(argv[i] + 1))) == NULL) {
+                        printf("kill: %s: No such job\n", argv[i]);
+                        laststatus = 1;
+                        continue;
+                }
+                pid = -job->pid;
+        }
+        else {
+                pid = strtol(argv[i], &end, 10);
+                if (end == argv[i] || *end != '\0') {
+                        printf("kill: %s: arguments must be process or job IDs\n", argv[i]);
+                        laststatus = 1;
+                        continue;
+                }
+        }
+        if (kill(pid, sig) < 0) {
+                printf("kill: (%s): %s\n", argv[i], strerror(errno));
+                laststatus = 1;
+        }
+            }
+    }
+
+    /* do_true, do_false - Execute the builtin true and false commands */
+    void do_true(char **argv) {
+            laststatus = 0;
+    }
+
+    void do_false(char **argv) {
+            laststatus = 1;
+    }
+
+    /* testint - Parse an integer operand of test, or print why it isn't one */
+    static int testint(const char *s, long long *n) {
+            char *end;
+
+            errno = 0;
+            *n = strtoll(s, &end, 10);
+            if (end == s || *end != '\0' || errno != 0) {
+        printf("test: %s: integer expression expected\n", s);
+        return 0;
+            }
+            return 1;
+    }
+
+    /*
+     * testexpr - Evaluate the test expression in argv[0..argc-1], by
+     *    the POSIX rules for up to four arguments, ! and ( expr )
+     *    included: the test is true (0), false (1), or the expression
+     *    is bad (2)
+     */
+    static int testexpr(int argc, char **argv) {
+            static const char *intops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+            const char *op;
+            struct stat st;
+            long long a, b;
+            int i, r;
+
+            if (argc == 0)
+        return 1;
+            if (argc == 1)
+        return argv[0][0] == '\0';
+            if (strcmp(argv[0], "!") == 0 && argc != 3)
+        return (r = testexpr(argc - 1, argv + 1)) == 2 ? 2 : !r;
+
+            if (argc == 2) {
+        op = argv[0];
+        if (strcmp(op, "-n") == 0)
+                return argv[1][0] == '\0';
+        if (strcmp(op, "-z") == 0)
+                return argv[1][0] != '\0';
+        if (op[0] != '-' || op[1] == '\0' || op[2] != '\0' || strchr("edfrwxsL", op[1]) == NULL) {
+                printf("test: %s: unary operator expected\n", op);
+                return 2;
+        }
+        if (op[1] == 'r' || op[1] == 'w' || op[1] == 'x')
+                return access(argv[1], op[1] == 'r' ? R_OK : op[1] == 'w' ? W_OK : X_OK) != 0;
+        if ((op[1] == 'L' ? lstat(argv[1], &st) : stat(argv[1], &st)) < 0)
+                return 1;
+        switch (op[1]) {
+        case 'd':
+                return !S_ISDIR(st.st_mode);
+        case 'f':
+                return !S_ISREG(st.st_mode);
+        case 's':
+                return st.st_size == 0;
+        case 'L':
+                return !S_ISLNK(st.st_mode);
+        }
+        return 0;
+            }
+
+            if (argc == 3) {
+        op = argv[1];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+                return strcmp(argv[0], argv[2]) != 0;
+        if (strcmp(op, "!=") == 0)
+                return strcmp(argv[0], argv[2]) == 0;
+        for (i = 0; i < 6; i++) {
+                if (strcmp(op, intops[i]) != 0)
+                        continue;
+                if (!testint(argv[0], &a) || !testint(argv[2], &b))
+                        return 2;
+                switch (i) {
+                case 0: return !(a == b);
+                case 1: return !(a != b);
+                case 2: return !(a < b);
+                case 3: return !(a <= b);
+                case 4: return !(a > b);
+                default: return !(a >= b);
+                }
+        }
+        if (strcmp(argv[0], "!") == 0)
+                return (r = testexpr(2, argv + 1)) == 2 ? 2 : !r;
+        if (strcmp(argv[0], "(") == 0 && strcmp(argv[2], ")") == 0)
+                return testexpr(1, argv + 1);
+        printf("test: %s: binary operator expected\n", op);
+        return 2;
+            }
+            if (argc == 4 && strcmp(argv[0], "(") == 0 && strcmp(argv[3], ")") == 0)
+        return testexpr(2, argv + 1);
+            printf("test: too many arguments\n");
+            return 2;
+    }
+
+    /*
+     * do_test - Execute the builtin test command, also called [, which
+     *    wants a ] after the expression
+     */
+    void do_test(char **argv) {
+            int argc;
+
+            for (argc = 0; argv[argc + 1] != NULL; argc++)
+        ;
+            if (argv[0][0] == '[') {
+        if (argc == 0 || strcmp(argv[argc], "]") != 0) {
+                printf("[: missing `]'\n");
+                laststatus = 2;
+                return;
+        }
+        argc--;
+            }
+            laststatus = testexpr(argc, argv + 1);
+    }
+
+    /***************************************
+     * Helper routines for launch attributes
+     ***************************************/
+
+    /*
+     * "on" and some attributes in front of a command run it with them
+     * set in each of its processes, between fork and exec:
+     *
+     *     cpus=LIST   the CPUs it may run on, e.g. 0-3,6 (sched_setaffinity)
+     *     nice=N      its niceness, -20 to 19 (setpriority)
+     *     mem=SIZE    its address space limit, with K, M, G or T (RLIMIT_AS)
+     *
+     * "on spread=cpu", or node, or off, on its own sets how background
+     * jobs that on gave no CPUs are placed: round-robin, one each to a
+     * CPU, or to the CPUs of a NUMA node, of those the shell may use.
+     * "on" alone prints that policy. jobs -l shows what each job was
+     * launched with.
+     */
+    static const char *spreadnames[] = {"off", "cpu", "node"};
+
+    /* parsecpus - Read a list like 0-3,6 into set; -1 if it isn't one */
+    static int parsecpus(const char *s, cpu_set_t *set) {
+            char *end;
+            long lo, hi;
+
+            CPU_ZERO(set);
+            do {
+        if (!isdigit((unsigned char)*s))
+                return -1;
+        lo = hi = strtol(s, &end, 10);
+        if (*end == '-') {
+                if (!isdigit((unsigned char)end[1]))
+                        return -1;
+                hi = strtol(end + 1, &end, 10);
+        }
+        if (hi < lo || hi >= CPU_SETSIZE)
+                return -1;
+        for (; lo <= hi; lo++)
+                CPU_SET(lo, set);
+        s = end;
+            } while (*s++ == ',');
+            return s[-1] == '\0' || s[-1] == '\n' ? 0 : -1;
+    }
+
+    /* readcpus - Read a list file from sysfs into set; -1 if we can't */
+    static int readcpus(const char *path, cpu_set_t *set) {
+            char buf[4096];
+            FILE *fp;
+            int r = -1;
+
+            if ((fp = fopen(path, "r")) != NULL) {
+        if (fgets(buf, sizeof(buf), fp) != NULL)
+                r = parsecpus(buf, set);
+        fclose(fp);
+            }
+            return r;
+    }
+
+    /* parsesize - Read a size like 512M into *size; -1 if it isn't one */
+    static int parsesize(const char *s, rlim_t *size) {
+            static const char units[] = "KMGT";
+            unsigned long long n;
+            const char *u;
+            char *end;
+            int shift;
+
+            if (!isdigit((unsigned char)*s))
+        return -1;
+            errno = 0;
+            n = strtoull(s, &end, 10);
+            if (errno == ERANGE)
+        return -1;
+            if (*end != '\0') {
+        if ((u = strchr(units, toupper((unsigned char)*end))) == NULL || end[1] != '\0')
+                return -1;
+        shift = 10 * (u - units + 1);
+        if (n > (ULLONG_MAX >> shift))  /* too big to be a size */
+                return -1;
+        n <<= shift;
+            }
+            *size = n;
+            return 0;
+    }
+
+    /*
+     * launchattrs - Take the attributes after the on that *argvp starts
+     *    with into attr, and leave *argvp at the command. spread= sets
+     *    the policy instead, and must come alone. Returns -1, having
+     *    said why, if an attribute is bad.
+     */
+    int launchattrs(char ***argvp, struct launchattr_t *attr) {
+            char **argv = *argvp + 1, *val, *end;
+            int policy = -1, i;
+            long n;
+
+            for (; *argv != NULL && (val = strchr(*argv, '=')) != NULL; argv++) {
+        val++;
+        if (strncmp(*argv, "cpus=", 5) == 0 && parsecpus(val, &attr->cpus) == 0) {
+                attr->set |= ATTR_CPUS;
+                continue;
+        }
+        if (strncmp(*argv, "nice=", 5) == 0) {
+                n = strtol(val, &end, 10);
+                if (end != val && *end == '\0' && n >= -20 && n <= 19) {
+                        attr->nice = n;
+                        attr->set |= ATTR_NICE;
+                        continue;
+                }
+        }
+        if (strncmp(*argv, "mem=", 4) == 0 && parsesize(val, &attr->mem) == 0) {
+                attr->set |= ATTR_MEM;
+                continue;
+        }
+        if (strncmp(*argv, "spread=", 7) == 0) {
+                for (i = 0; i < 3 && strcmp(val, spreadnames[i]) != 0; i++)
+                        ;
+                if (i < 3) {
+                        policy = i;
+                        continue;
+                }
+        }
+        printf("on: bad attribute: %s\n", *argv);
+        laststatus = 2;
+        return -1;
+            }
+
+            laststatus = 0;
+            if (policy >= 0) {
+        if (*argv != NULL || attr->set) {
+                printf("on: spread= goes on its own\n");
+                laststatus = 2;
+                return -1;
+        }
+        spread = policy;
+            }
+            else if (*argv == NULL) {
+        if (attr->set) {
+                printf("on: no command\n");
+                laststatus = 2;
+                return -1;
+        }
+        printf("spread=%s\n", spreadnames[spread]);
+            }
+            *argvp = argv;
+            return 0;
+    }
+
+    /*
+     * spreadattrs - Give attr the next place in turn under the spread
+     *    policy: a CPU, or a NUMA node's CPUs, of those the shell may
+     *    run on. The places are worked out when the policy is set.
+     */
+    void spreadattrs(struct launchattr_t *attr) {
+            static cpu_set_t *places;
+            static size_t nplaces, cap, next;
+            static int policy = SPREAD_OFF;     /* what places is for */
+            char path[64];
+            cpu_set_t allowed, nodes, set;
+            int i;
+
+            if (policy != spread) {
+        policy = spread;
+        nplaces = next = 0;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+                unix_error("sched_getaffinity error");
+        for (i = 0; i < CPU_SETSIZE; i++) {
+                if (policy == SPREAD_CPU && CPU_ISSET(i, &allowed)) {
+                        CPU_ZERO(&set);
+                        CPU_SET(i, &set);
+                }
+                else if (policy == SPREAD_NODE && i == 0 &&
+                         readcpus("/sys/devices/system/node/online", &nodes) < 0)
+                        break;          /* no NUMA: the one place below */
+                else if (policy == SPREAD_NODE && CPU_ISSET(i, &nodes)) {
+                        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+                        if (readcpus(path, &set) < 0)
+                                continue;       /* a node with memory only */
+                        CPU_AND(&set, &set, &allowed);
+                        if (CPU_COUNT(&set) == 0)
+                                continue;
+                }
+                else
+                        continue;
+                places = grow(places, &cap, nplaces + 1, sizeof(*places));
+                places[nplaces++] = set;
+        }
+        if (nplaces == 0) {
+                places = grow(places, &cap, 1, sizeof(*places));
+                places[nplaces++] = allowed;
+        }
+            }
+            attr->cpus = places[next++ % nplaces];
+            attr->set |= ATTR_CPUS;
+    }
+
+    /*
+     * applyattrs - Set attr in this process, a child between fork and
+     *    exec. Returns -1, having said which failed, if one does.
+     */
+    int applyattrs(const struct launchattr_t *attr) {
+            struct rlimit rl;
+
+            if ((attr->set & ATTR_CPUS) && sched_setaffinity(0, sizeof(attr->cpus), &attr->cpus) < 0) {
+        printf("on: cpus: %s\n", strerror(errno));
+        return -1;
+            }
+            if ((attr->set & ATTR_NICE) && setpriority(PRIO_PROCESS, 0, attr->nice) < 0) {
+        printf("on: nice: %s\n", strerror(errno));
+        return -1;
+            }
+            if (attr->set & ATTR_MEM) {
+        getrlimit(RLIMIT_AS, &rl);
+        rl.rlim_cur = attr->mem;
+        if (setrlimit(RLIMIT_AS, &rl) < 0) {
+                printf("on: mem: %s\n", strerror(errno));
+                return -1;
+        }
+            }
+            return 0;
+    }
+
+    /* printattrs - Print attr the way on takes it, then a newline */
+    void printattrs(const struct launchattr_t *attr) {
+            static const char *units[] = {"", "K", "M", "G", "T"};
+            unsigned long long mem = attr->mem;
+            char sep = '=';
+            int cpu, lo, i;
+
+            if (attr->set & ATTR_CPUS) {
+        printf(" cpus");
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (!CPU_ISSET(cpu, &attr->cpus))
+                        continue;
+                for (lo = cpu; cpu + 1 < CPU_SETSIZE && CPU_ISSET(cpu + 1, &attr->cpus); cpu++)
+                        ;
+                if (lo == cpu)
+                        printf("%c%d", sep, cpu);
+                else
+                        printf("%c%d-%d", sep, lo, cpu);
+                sep = ',';
+        }
+            }
+            if (attr->set & ATTR_NICE)
+        printf(" nice=%d", attr->nice);
+            if (attr->set & ATTR_MEM) {
+        for (i = 0; i < 4 && mem != 0 && mem % 1024 == 0; i++)
+                mem /= 1024;
+        printf(" mem=%llu%s", mem, units[i]);
+            }
+            printf("\n");
+    }
+
+    /***************************************
+     * Helper routines for job deadlines
+     ***************************************/
+
+    /*
+     * "timeout [-k GRACE] DURATION" in front of a command gives its job
+     * a deadline. On its own it sets one for every background job not
+     * given its own; "timeout off" drops that, and "timeout" alone
+     * prints it. A duration is a number, maybe with a fraction, and a
+     * unit of ms, s (the default), m, h or d.
+     *
+     * When a deadline passes the job's process group is sent SIGTERM,
+     * and SIGCONT in case it is stopped, and after GRACE more (default
+     * TIMEOUTGRACE) SIGKILL. All the deadlines are kept in one min-heap
+     * by when they fall due, with a single timerfd in the epoll set
+     * armed for the earliest, so thousands cost nothing until one falls
+     * due. Each job knows its place in the heap, so a job that ends in
+     * time is taken out in O(log n).
+     */
+    #define TIMEOUTGRACE 5000000000LL  /* ns from SIGTERM to SIGKILL */
+
+    struct deadline_t {             /* One entry of the deadline heap */
+            long long when;         /* CLOCK_MONOTONIC ns it falls due */
+            struct job_t *job;
+    };
+    static struct deadline_t *deadlines;
+    static size_t ndeadlines, deadlinecap;
+    static int timerfd = -1;
+    static long long timerset;      /* when the timer is armed for, or 0 */
+
+    /* nsnow - CLOCK_MONOTONIC in ns */
+    static long long nsnow(void) {
+            struct timespec ts;
+
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    /* parseduration - Read a duration like 1.5s or 200ms into *ns; -1 if it isn't one */
+    static int parseduration(const char *s, long long *ns) {
+            static const char *units[] = {"ms", "s", "", "m", "h", "d"};
+            static const double scale[] = {1e6, 1e9, 1e9, 60e9, 3600e9, 86400e9};
+            char *end;
+            double d;
+            int i;
+
+            if (!isdigit((unsigned char)*s) && *s != '.')
+        return -1;
+            d = strtod(s, &end);
+            for (i = 0; i < 6; i++)
+        if (strcmp(end, units[i]) == 0) {
+                if ((d *= scale[i]) < 1 || d > 1e18)
+                        return -1;
+                *ns = d;
+                return 0;
+        }
+            return -1;
+    }
+
+    /*
+     * timeoutprefix - Take the durations after the timeout that *argvp
+     *    starts with into *ns and *grace, and leave *argvp at the
+     *    command. With no command they become the default instead.
+     *    Returns -1, having said why, if a duration is bad.
+     */
+    int timeoutprefix(char ***argvp, long long *ns, long long *grace) {
+            char **argv = *argvp + 1;
+
+            laststatus = 0;
+            *grace = TIMEOUTGRACE;
+            if (*argv == NULL) {
+        if (deftimeout > 0)
+                printf("timeout -k %gs %gs\n", defgrace / 1e9, deftimeout / 1e9);
+        else
+                printf("timeout off\n");
+        *argvp = argv;
+        return 0;
+            }
+            if (strcmp(*argv, "off") == 0 && argv[1] == NULL) {
+        deftimeout = 0;
+        *argvp = argv + 1;
+        return 0;
+            }
+            if (strcmp(*argv, "-k") == 0 && argv[1] != NULL) {
+        if (parseduration(argv[1], grace) < 0) {
+                printf("timeout: bad duration: %s\n", argv[1]);
+                laststatus = 2;
+                return -1;
+        }
+        argv += 2;
+            }
+            if (*argv == NULL || parseduration(*argv, ns) < 0) {
+        if (*argv == NULL)
+                printf("timeout: missing duration\n");
+        else
+                printf("timeout: bad duration: %s\n", *argv);
+        laststatus = 2;
+        return -1;
+            }
+            if (*++argv == NULL) {
+        deftimeout = *ns;
+        defgrace = *grace;
+            }
+            *argvp = argv;
+            return 0;
+    }
+
+    /* heapset - Put d at place i of the deadline heap, and tell its job */
+    static void heapset(size_t i, struct deadline_t d) {
+            deadlines[i] = d;
+            d.job->stats->deadline = i + 1;
+    }
+
+    /* siftdeadline - Move the deadline at place i up or down to where it belongs */
+    static void siftdeadline(size_t i) {
+            struct deadline_t d = deadlines[i];
+            size_t child;
+
+            while (i > 0 && deadlines[(i - 1) / 2].when > d.when) {
+        heapset(i, deadlines[(i - 1) / 2]);
+        i = (i - 1) / 2;
+            }
+            while ((child = 2 * i + 1) < ndeadlines) {
+        if (child + 1 < ndeadlines && deadlines[child + 1].when < deadlines[child].when)
+                child++;
+        if (deadlines[child].when >= d.when)
+                break;
+        heapset(i, deadlines[child]);
+        i = child;
+            }
+            heapset(i, d);
+    }
+
+    /* heapput - Make when a job's deadline, whether or not it has one */
+    static void heapput(struct job_t *job, long long when) {
+            size_t i = job->stats->deadline;
+
+            if (i == 0) {
+        deadlines = grow(deadlines, &deadlinecap, ndeadlines + 1, sizeof(*deadlines));
+        i = ++ndeadlines;
+            }
+            deadlines[i - 1].when = when;
+            deadlines[i - 1].job = job;
+            siftdeadline(i - 1);
+    }
+
+    /* heapdel - Take a job's deadline out of the heap */
+    static void heapdel(struct job_t *job) {
+            size_t i = job->stats->deadline;
+
+            job->stats->deadline = 0;
+            if (--ndeadlines > i - 1) {     /* fill the hole with the last one */
+        deadlines[i - 1] = deadlines[ndeadlines];
+        siftdeadline(i - 1);
+            }
+    }
+
+    /* armtimer - Arm the timer for the earliest deadline, if that has changed */
+    static void armtimer(void) {
+            struct epoll_event ev = {EPOLLIN, {.u64 = EP_TIMER}};
+            struct itimerspec its = {{0, 0}, {0, 0}};
+            long long when = ndeadlines > 0 ? deadlines[0].when : 0;
+
+            if (when == timerset)
+        return;
+            if (timerfd < 0) {
+        if ((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+                unix_error("timerfd_create error");
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev) < 0)
+                unix_error("epoll_ctl error");
+            }
+            its.it_value.tv_sec = when / 1000000000;     /* all 0 disarms it */
+            its.it_value.tv_nsec = when % 1000000000;
+            if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        unix_error("timerfd_settime error");
+            timerset = when;
+    }
+
+    /* setdeadline - Give a job ns more to run, and then grace after SIGTERM */
+    void setdeadline(struct job_t *job, long long ns, long long grace) {
+            job->stats->grace = grace;
+            heapput(job, nsnow() + ns);
+            armtimer();
+    }
+
+    /* cleardeadline - Drop a job's deadline, if it has one */
+    void cleardeadline(struct job_t *job) {
+            if (job->stats->deadline == 0)
+        return;
+            heapdel(job);
+            armtimer();
+    }
+
+    /*
+     * expiredeadlines - Act on every deadline that has passed, when the
+     *    timer fires: SIGTERM the job and give it its grace, or SIGKILL
+     *    it if that is up too. Its end is reported as killed by timeout.
+     */
+    void expiredeadlines(void) {
+            unsigned long long fired;
+            struct job_t *job;
+            long long now = nsnow();
+
+            if (read(timerfd, &fired, sizeof(fired)) < 0 && errno != EAGAIN)
+        unix_error("timerfd read error");
+            timerset = 0;           /* it has gone off, so isn't armed */
+            while (ndeadlines > 0 && deadlines[0].when <= now) {
+        job = deadlines[0].job;
+        if (!job->stats->timedout) {
+                job->stats->timedout = 1;
+                kill(-job->pid, SIGTERM);
+                TRACE(EV_SIGNAL, 0, job->pid, SIGTERM);
+                if (job->state == ST)
+                        contjob(jobs, job, BG);
+                heapput(job, now + job->stats->grace);
+        }
+        else {
+                kill(-job->pid, SIGKILL);
+                TRACE(EV_SIGNAL, 0, job->pid, SIGKILL);
+                heapdel(job);
+        }
+            }
+            armtimer();
+    }
+
+    /***************************************
+     * Helper routines for the parallel builtin
+     ***************************************/
+
+    struct parinput_t {             /* where parallel's arguments come from */
+            char **list;            /* ::: arguments, or NULL */
+            char **files;           /* :::: or -a files not yet opened */
+            FILE *fp;               /* the stream being read, or NULL */
+            int shellin;            /* read the shell's own stdin first */
+            char *line;             /* line buffer, for getline and readline */
+            size_t cap;
+            char *next;             /* an argument read but not yet used */
+    };
+
+    struct partask_t {              /* argv of one task, reused */
+            char **tmpl;            /* the command template */
+            char **argv;            /* the task's argv */
+            size_t argvcap;
+            char **args;            /* the arguments it was given */
+            int nargs;
+            size_t argscap;
+            char *buf;              /* template words with {} filled in */
+            size_t bufcap;
+    };
+
+    /* 
+     * nextarg - Return the next argument: from the ::: list, else one
+     *    per non-empty line of the shell's stdin or of each file in turn,
+     *    or NULL if there are no more. Arguments read from a file are
+     *    malloc'd.
+     */
+    static char *nextarg(struct parinput_t *in) {
+            char *arg;
+            ssize_t n;
+
+            if ((arg = in->next) != NULL) {
+        in->next = NULL;
+        return arg;
+            }
+            if (in->list != NULL)
+        return *in->list != NULL ? *in->list++ : NULL;
+
+            while (in->shellin) {
+        if ((n = readline(&input, &in->line, &in->cap)) == 0) {
+                in->shellin = 0;
+                input.eof = 0;  /* the shell keeps reading after a ctrl-d */
+                break;
+        }
+        if (in->line[n-1] == '\n')
+                in->line[--n] = '\0';
+        if (n > 0) {
+                if ((arg = strdup(in->line)) == NULL)
+                        unix_error("strdup error");
+                return arg;
+        }
+            }
+            while (1) {
+        if (in->fp == NULL) {
+                if (*in->files == NULL)
+                        return NULL;
+                if ((in->fp = fopen(*in->files, "r")) == NULL)
+                        printf("parallel: %s: %s\n", *in->files, strerror(errno));
+                in->files++;
+                continue;
+        }
+        if ((n = getline(&in->line, &in->cap, in->fp)) < 0) {
+                fclose(in->fp);
+                in->fp = NULL;
+                continue;
+        }
+        if (n > 0 && in->line[n-1] == '\n')
+                in->line[--n] = '\0';
+        if (n == 0)
+                continue;
+        if ((arg = strdup(in->line)) == NULL)
+                unix_error("strdup error");
+        return arg;
+            }
+    }
+
+    /* substcount - Number of {} in a template word */
+    static int substcount(const char *word) {
+            int n = 0;
+
+            while ((word = strstr(word, "{}")) != NULL) {
+        n++;
+        word += 2;
+            }
+            return n;
+    }
+
+    /*
+     * argcost - Bytes of exec argument space that adding arg to a task
+     *    takes up: every template word with {} in it grows by arg, and
+     *    words that are more than a bare {} are repeated once per
+     *    argument. A template without {} has the argument appended.
+     */
+    static long argcost(char **tmpl, const char *arg) {
+            long len = strlen(arg), cost = 0;
+            int i, n, subst = 0;
+
+            for (i = 0; tmpl[i] != NULL; i++) {
+        if ((n = substcount(tmpl[i])) == 0)
+                continue;
+        cost += strlen(tmpl[i]) + n * (len - 2) + 1 + sizeof(char *);
+        subst = 1;
+            }
+            return subst ? cost : len + 1 + sizeof(char *);
+    }
+
+    /*
+     * mkbatch - Build the next task's argv from the template: take up to
+     *    max arguments, as many as fit in room bytes of exec argument
+     *    space, and fill them in for {}. A bare {} word stands for all
+     *    of them; any other word containing {} is repeated for each one.
+     *    Returns the argv, or NULL when the arguments have run out.
+     */
+    static char **mkbatch(struct partask_t *t, struct parinput_t *in, int max, long room) {
+            char *arg, *d, *s;
+            size_t need = 0;
+            int i, j, n = 0, subst = 0;
+            long cost;
+
+            for (i = 0; i < t->nargs; i++)  /* free the last task's arguments */
+        if (in->list == NULL)
+                free(t->args[i]);
+            t->nargs = 0;
+            while (t->nargs < max && (arg = nextarg(in)) != NULL) {
+        cost = argcost(t->tmpl, arg);
+        if (t->nargs > 0 && cost > room) {
+                in->next = arg;         /* it starts the next task */
+                break;
+        }
+        room -= cost;
+        t->args = grow(t->args, &t->argscap, t->nargs + 1, sizeof(char *));
+        t->args[t->nargs++] = arg;
+            }
+            if (t->nargs == 0)
+        return NULL;
+
+            for (i = 0; t->tmpl[i] != NULL; i++) {
+        if (substcount(t->tmpl[i]) == 0)
+                continue;
+        subst = 1;
+        if (strcmp(t->tmpl[i], "{}") != 0)
+                for (j = 0; j < t->nargs; j++)
+                        need += strlen(t->tmpl[i]) + substcount(t->tmpl[i]) * strlen(t->args[j]) + 1;
+            }
+            if (need > t->bufcap) {
+        free(t->buf);
+        t->bufcap = need;
+        if ((t->buf = malloc(need)) == NULL)
+                unix_error("malloc error");
+            }
+
+            d = t->buf;
+            for (i = 0; t->tmpl[i] != NULL; i++) {
+        t->argv = grow(t->argv, &t->argvcap, n + t->nargs + 2, sizeof(char *));
+        if (substcount(t->tmpl[i]) == 0)
+                t->argv[n++] = t->tmpl[i];
+        else if (strcmp(t->tmpl[i], "{}") == 0)
+                for (j = 0; j < t->nargs; j++)
+                        t->argv[n++] = t->args[j];
+        else {
+                for (j = 0; j < t->nargs; j++) {
+                        t->argv[n++] = d;
+                        for (s = t->tmpl[i]; *s; s++) {
+                                if (s[0] == '{' && s[1] == '}') {
+                                        d = stpcpy(d, t->args[j]);
+                                        s++;
+                                }
+                                else
+                                        *d++ = *s;
+                        }
+                        *d++ = '\0';
+                }
+        }
+            }
+            if (!subst) {
+        t->argv = grow(t->argv, &t->argvcap, n + t->nargs + 1, sizeof(char *));
+        for (j = 0; j < t->nargs; j++)
+                t->argv[n++] = t->args[j];
+            }
+            t->argv[n] = NULL;
+            return t->argv;
+    }
+
+    /*
+     * do_parallel - Execute the builtin parallel command
+     *    parallel [-j N] [-n MAX | -X] [-a FILE] cmd [arg...] [::: arg... | :::: FILE...]
+     *
+     *    Runs cmd once per argument, with {} in its words replaced by the
+     *    argument (or the argument appended if there is no {}). The
+     *    arguments follow :::, or are read one per line from the files
+     *    after :::: or -a, or else from stdin. Exactly N tasks (default:
+     *    the number of CPUs) are kept running: all of them belong to one
+     *    foreground job, and each time reapchildren reaps one we start
+     *    the next. With -n each task gets up to MAX arguments, and with
+     *    -X as many as will fit under ARG_MAX, like xargs. Ctrl-c stops
+     *    the run; ctrl-z stops the running tasks as a job that fg and bg
+     *    can resume, but no new tasks are started. Ends with a count of
+     *    how the tasks exited.
+     */
+    void do_parallel(char **argv) {
+            struct parinput_t in = {NULL};
+            struct partask_t task = {NULL};
+            struct job_t *job = NULL, *prevfg = jobs->fg;
+            char *afile[2] = {NULL, NULL}, *opt, **targv;
+            static char *cmdline;   /* kept from call to call, like the line buffers */
+            static size_t cmdcap;
+            size_t len;
+            sigset_t mask;
+            struct stage_t stage;
+            int status[64];
+            int njobs = sysconf(_SC_NPROCESSORS_ONLN), max = 1, taskin = STDIN_FILENO;
+            int ntasks = 0, nok = 0, nfailed = 0, nkilled = 0, done = 0, i, n;
+            char c;
+            long room;
+            pid_t pid;
+
+            /* Keep the command line for jobs before ::: is cut off below */
+            for (i = 0, len = 0; argv[i] != NULL; i++) {
+        n = strlen(argv[i]);
+        cmdline = grow(cmdline, &cmdcap, len + n + 3, 1);
+        if (i > 0)
+                cmdline[len++] = ' ';
+        memcpy(cmdline + len, argv[i], n);
+        len += n;
+            }
+            cmdline = grow(cmdline, &cmdcap, len + 2, 1);
+            strcpy(cmdline + len, "\n");
+
+            for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if ((c = argv[i][1]) == 'X' && argv[i][2] == '\0') {
+                max = INT_MAX;
+                continue;
+        }
+        if (c == '\0' || strchr("jna", c) == NULL ||
+            (opt = argv[i][2] ? &argv[i][2] : argv[++i]) == NULL)
+                break;
+        if (c == 'a')
+                afile[0] = opt;
+        else if ((n = atoi(opt)) < 1) {
+                printf("parallel: %s: invalid number\n", opt);
+                return;
+        }
+        else if (c == 'j')
+                njobs = n;
+        else
+                max = n;
+            }
+            if (argv[i] == NULL || argv[i][0] == '-' || !strcmp(argv[i], ":::") || !strcmp(argv[i], "::::")) {
+        printf("parallel: usage: parallel [-j N] [-n MAX | -X] [-a FILE] "
+               "cmd [arg...] [::: arg... | :::: FILE...]\n");
+        return;
+            }
+
+            /* The template runs up to ::: or :::: */
+            task.tmpl = &argv[i];
+            while (argv[i] != NULL && strcmp(argv[i], ":::") && strcmp(argv[i], "::::"))
+        i++;
+            if (argv[i] != NULL) {
+        if (argv[i][3] == ':')
+                in.files = &argv[i+1];
+        else
+                in.list = &argv[i+1];
+        argv[i] = NULL;
+            }
+            else {
+        in.files = afile;
+        if (afile[0] == NULL) {
+                /* Tasks must not eat the arguments still to be read */
+                if (builtin_in == STDIN_FILENO)
+                        in.shellin = 1;
+                else if ((in.fp = fdopen(dup(builtin_in), "r")) == NULL)
+                        unix_error("parallel error");
+                if ((taskin = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+                        unix_error("parallel error");
+        }
+            }
+            if (findcmd(task.tmpl[0]) == NULL) {
+        printf("%s: Command not found\n", task.tmpl[0]);
+        goto out;
+            }
+
+            /* What exec allows, less the environment and the fixed words */
+            room = sysconf(_SC_ARG_MAX) - 2048 - sizeof(char *);
+            for (i = 0; environ[i] != NULL; i++)
+        room -= strlen(environ[i]) + 1 + sizeof(char *);
+            for (i = 0; task.tmpl[i] != NULL; i++)
+        if (substcount(task.tmpl[i]) == 0)
+                room -= strlen(task.tmpl[i]) + 1 + sizeof(char *);
+
+            sigprocmask(SIG_BLOCK, NULL, &mask);
+            kbdsig = 0;
+            fflush(stdout);
+
+            while (1) {
+        /* Fill the free slots */
+        while (!done && !kbdsig && (job == NULL || job->nprocs < njobs)) {
+                if ((targv = mkbatch(&task, &in, max, room)) == NULL) {
+                        done = 1;
+                        break;
+                }
+                stage.argv = targv;
+                stage.nredirs = 0;
+                ntasks++;
+                /* Once the whole group has been reaped it is gone, so start a new one */
+                if ((pid = launch(&stage, &mask, job != NULL && job->nprocs > 0 ? job->pid : 0,
+                                  taskin, STDOUT_FILENO, NULL)) == 0) {
+                        nfailed++;
+                        continue;
+                }
+                if (job == NULL) {
+                        if (!addjob(jobs, pid, FG, cmdline)) {
+                                Kill(pid, SIGKILL);
+                                waitpid(pid, NULL, 0);
+                                nkilled++;
+                                break;
+                        }
+                        job = getjobpid(jobs, pid);
+                        job->held = 1;
+                }
+                else {
+                        if (job->nprocs == 0)
+                                job->pid = pid;
+                        addproc(jobs, job, pid);
+                }
+                watchproc(jobs, pid);
+                /* A ctrl-c or ctrl-z that came in while it started missed it */
+                if (kbdsig)
+                        kill(-job->pid, kbdsig);
+        }
+        if (job == NULL)
+                break;
+
+        handlesignals();
+        while ((n = pruneprocs(jobs, job, status, 64)) > 0) {
+                for (i = 0; i < n; i++) {
+                        if (WIFEXITED(status[i]) && WEXITSTATUS(status[i]) == 0)
+                                nok++;
+                        else if (WIFEXITED(status[i]))
+                                nfailed++;
+                        else
+                                nkilled++;
+                }
+        }
+        if (job->state == ST || (job->nprocs == 0 && (done || kbdsig)))
+                break;
+        if (job->nprocs >= njobs || done || kbdsig)
+                waitinput(-1);
+            }
+
+            printf("parallel: %d tasks: %d ok, %d failed, %d killed", ntasks, nok, nfailed, nkilled);
+            if (job != NULL && job->state == ST)
+        printf(", %d stopped as job [%d]", job->nprocs, job->jid);
+            printf("\n");
+            if (job != NULL) {
+        job->held = 0;
+        if (job->nprocs == 0)
+                removejob(jobs, job);
+            }
+            /* Run as the last stage of a pipeline, give the pipeline back the foreground */
+            if (jobs->fg == NULL && prevfg != NULL && prevfg->state == FG)
+        jobs->fg = prevfg;
+
+     out:
+            mkbatch(&task, &in, 0, 0);      /* frees the last task's arguments */
+            if (in.list == NULL)
+        free(in.next);
+            if (in.fp != NULL)
+        fclose(in.fp);
+            if (taskin != STDIN_FILENO)
+        close(taskin);
+            free(in.line);
+            free(task.argv);
+            free(task.args);
+            free(task.buf);
+    }
+
+    /***************************************
+     * Helper routines for command history
+     ***************************************/
+
+    /*
+     * Each line typed at the read/eval loop is appended to a history
+     * file that any number of shells share: $TSH_HISTORY, or else
+     * ~/.tsh_history. A line goes in with a single O_APPEND write, so
+     * lines from concurrent shells never interleave. A shell run with
+     * -p, as the tests run it, or with its input not a terminal, as
+     * under a driver or a benchmark, keeps its history in a memfd of
+     * its own instead, unless TSH_HISTORY names a file. TSH_HISTORY
+     * set but empty keeps it private always.
+     *
+     * The entries are read through a shared mapping of the file and
+     * numbered from 1 in the order they were written, so every shell
+     * agrees on the numbers. Nothing is read at startup. The first
+     * command that looks at the history maps the file and indexes it,
+     * and later ones only index what has been appended since, by this
+     * shell or another. The index has the offset of each entry, for
+     * !n, and a radix tree of the entries' text, for !prefix. Each tree
+     * node knows the newest entry below it, so finding the newest entry
+     * that starts with a prefix takes a walk as long as the prefix, not
+     * the history. Labels are offsets into the file, so the tree holds
+     * no copy of the text, and the edges are one hash table on parent
+     * and first byte, so each step of the walk is a single probe rather
+     * than a scan of the siblings.
+     *
+     *     history [n]        list the last n entries, or all of them
+     *     history -s text    list the entries containing text
+     *     !n, !-n, !!        run entry n, the nth last, or the last again
+     *     !prefix            run the newest entry starting with prefix
+     *
+     * An event is only looked for as the first word of a line. The rest
+     * of the line is appended to the entry, and the expanded line is
+     * printed, recorded and run in place of the one typed.
+     */
+    #define HISTLABELMAX ((1 << 24) - 1)   /* longest label; entries past it are cut */
+    #define HISTSLICE (256 * 1024)          /* bytes indexed per wait for input */
+
+    struct histnode_t {             /* One node of the prefix tree */
+            size_t off;             /* label: the len bytes at off in the file */
+            unsigned len : 24;
+            unsigned first : 8;     /* the label's first byte, to check an edge */
+            unsigned newest;        /* newest entry at or below this node */
+    };
+    struct histedge_t {             /* One slot of the edge table */
+            unsigned parent;
+            unsigned child;         /* 0 if the slot is free */
+    };
+    static int histfd = -1;
+    static char *histmap;           /* the file, mapped read-only */
+    static size_t histmapped;       /* bytes mapped */
+    static size_t histindexed;      /* bytes indexed, up to the last whole line */
+    static size_t *histoff;         /* histoff[n - 1] is where entry n starts */
+    static size_t nhist, histcap;
+    static struct histnode_t *histnodes;    /* histnodes[0] is the root */
+    static size_t nhistnodes, histnodecap;
+    static struct histedge_t *histedges;    /* open addressing, at most half full */
+    static size_t nhistedges, histedgecap;
+
+    /* histopen - Open the shared history file, or a private one unless persist; reads nothing */
+    void histopen(int persist) {
+            char *file = getenv("TSH_HISTORY"), *home, path[PATH_MAX];
+
+            if (file != NULL && *file == '\0')     /* asked to keep it private */
+        file = NULL;
+            else if (file == NULL && persist && (home = getenv("HOME")) != NULL) {
+        snprintf(path, sizeof(path), "%s/.tsh_history", home);
+        file = path;
+            }
+            if (file != NULL && (histfd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) < 0)
+        printf("history: %s: %s\n", file, strerror(errno));
+            if (histfd < 0 && (histfd = memfd_create("tsh-history", MFD_CLOEXEC)) < 0)
+        unix_error("memfd_create error");
+    }
+
+    /* histadd - Append a line read at the prompt, newline and all, to the history */
+    void histadd(const char *line) {
+            const char *s;
+
+            for (s = line; isspace((unsigned char)*s); s++)
+        ;
+            if (*s != '\0' && write(histfd, line, strlen(line)) < 0)
+        printf("history: write error: %s\n", strerror(errno));
+    }
+
+    /* histnode - Add a node to the prefix tree and return its index */
+    static unsigned histnode(size_t off, unsigned len, unsigned newest) {
+            histnodes = grow(histnodes, &histnodecap, nhistnodes + 1, sizeof(*histnodes));
+            histnodes[nhistnodes] = (struct histnode_t){off, len, (unsigned char)histmap[off], newest};
+            return nhistnodes++;
+    }
+
+    /* histslot - The edge slot for node a's child starting with c, or the free slot it would take */
+    static struct histedge_t *histslot(unsigned a, unsigned char c) {
+            size_t i = ((a * 0x9e3779b1u) ^ (c * 0x85ebca77u)) & (histedgecap - 1);
+
+            while (histedges[i].child != 0 &&
+                   (histedges[i].parent != a || histnodes[histedges[i].child].first != c))
+        i = (i + 1) & (histedgecap - 1);
+            return &histedges[i];
+    }
+
+    /* histreserve - Make room for n more edges, keeping the table at most half full */
+    static void histreserve(size_t n) {
+            struct histedge_t *old = histedges;
+            size_t i, oldcap = histedgecap;
+
+            if (2 * (nhistedges + n) <= histedgecap)
+        return;
+            histedgecap = oldcap ? 2 * oldcap : 1024;
+            if ((histedges = calloc(histedgecap, sizeof(*histedges))) == NULL)
+        unix_error("calloc error");
+            for (i = 0; i < oldcap; i++)
+        if (old[i].child != 0)
+                *histslot(old[i].parent, histnodes[old[i].child].first) = old[i];
+            free(old);
+    }
+
+    /* histlink - Make b a child of a */
+    static void histlink(unsigned a, unsigned b) {
+            *histslot(a, histnodes[b].first) = (struct histedge_t){a, b};
+            nhistedges++;
+    }
+
+    /* histinsert - Put entry n, the len bytes at off, in the prefix tree */
+    static void histinsert(unsigned n, size_t off, size_t len) {
+            struct histedge_t *e;
+            unsigned a = 0, b, h;
+            size_t i, j;
+
+            if (nhistnodes == 0)
+        histnode(0, 0, 0);
+            if (len > HISTLABELMAX)
+        len = HISTLABELMAX;
+            histreserve(2);                 /* a split and a new leaf at most */
+            histnodes[0].newest = n;
+            for (i = 0; i < len; i += j, a = b) {
+        e = histslot(a, histmap[off + i]);
+        if ((b = e->child) == 0) {
+                histlink(a, histnode(off + i, len - i, n));
+                return;
+        }
+        for (j = 1; j < histnodes[b].len && i + j < len &&
+                    histmap[histnodes[b].off + j] == histmap[off + i + j]; j++)
+                ;
+        if (j < histnodes[b].len) {
+                /* Split b where the entry leaves it: b keeps the tail, and its children */
+                h = histnode(histnodes[b].off, j, n);
+                e->child = h;
+                histnodes[b].off += j;
+                histnodes[b].len -= j;
+                histnodes[b].first = histmap[histnodes[b].off];
+                histlink(h, b);
+                b = h;
+        }
+        histnodes[b].newest = n;
+            }
+    }
+
+    /*
+     * histsync - Map whatever has been added to the file and index about
+     *    max bytes more of it, a whole line at a time. Returns true if it
+     *    stopped short of the end.
+     */
+    static int histsync(size_t max) {
+            struct stat st;
+            char *p, *nl, *end;
+
+            if (histfd < 0 || fstat(histfd, &st) < 0 || (size_t)st.st_size <= histindexed)
+        return 0;
+            if ((size_t)st.st_size > histmapped) {
+        p = histmapped == 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, histfd, 0)
+                            : mremap(histmap, histmapped, st.st_size, MREMAP_MAYMOVE);
+        if (p == MAP_FAILED)
+                unix_error("mmap error");
+        histmap = p;
+        histmapped = st.st_size;
+            }
+            end = histmap + histmapped;
+            if (max < histmapped - histindexed &&
+                (nl = memchr(histmap + histindexed + max, '\n', histmapped - histindexed - max)) != NULL)
+        end = nl + 1;
+            for (p = histmap + histindexed; (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1) {
+        histoff = grow(histoff, &histcap, nhist + 1, sizeof(*histoff));
+        histoff[nhist++] = p - histmap;
+        histinsert(nhist, p - histmap, nl - p);
+            }
+            histindexed = p - histmap;
+            return end < histmap + histmapped;
+    }
+
+    /*
+     * histidle - Index the next slice of the history while the shell
+     *    waits for a line, so a big file is indexed by the time anyone
+     *    looks in it; returns true while there is more to do
+     */
+    int histidle(void) {
+            return histsync(HISTSLICE);
+    }
+
+    /* histlen - Length of entry n, without its newline */
+    static size_t histlen(size_t n) {
+            return (n < nhist ? histoff[n] : histindexed) - histoff[n - 1] - 1;
+    }
+
+    /* histfind - The newest entry starting with the len bytes at s, or 0 */
+    static size_t histfind(const char *s, size_t len) {
+            unsigned a = 0;
+            size_t i, j;
+
+            histsync(SIZE_MAX);
+            if (nhistnodes == 0)
+        return 0;
+            for (i = 0; i < len; i += j) {
+        if ((a = histslot(a, s[i])->child) == 0)
+                return 0;
+        for (j = 1; j < histnodes[a].len && i + j < len; j++)
+                if (histmap[histnodes[a].off + j] != s[i + j])
+                        return 0;
+            }
+            return histnodes[a].newest;
+    }
+
+    /*
+     * histexpand - If the first word of *line is a history event, put the
+     *    entry it names in its place, print the line and return 1. Returns
+     *    0 if there is no event, and -1, having said so, if there is no
+     *    such entry.
+     */
+    int histexpand(char **line, size_t *cap) {
+            char *s = *line, *w, *end;
+            size_t n, len, rest, restlen;
+            long k;
+
+            while (isspace((unsigned char)*s))
+        s++;
+            if (*s != '!' || s[1] == '\0' || isspace((unsigned char)s[1]))
+        return 0;
+            w = s + 1;
+            for (end = w; *end != '\0' && !isspace((unsigned char)*end); end++)
+        ;
+            histsync(SIZE_MAX);
+            if (*w == '!' && end == w + 1)
+        n = nhist;
+            else if ((k = strtol(w, &s, 10)) != 0 && s == end)
+        n = k > 0 ? (size_t)k : (size_t)-k <= nhist ? nhist + 1 + k : 0;
+            else
+        n = histfind(w, end - w);
+            if (n == 0 || n > nhist) {
+        printf("!%.*s: event not found\n", (int)(end - w), w);
+        laststatus = 1;
+        return -1;
+            }
+
+            len = histlen(n);
+            rest = end - *line;
+            restlen = strlen(end);
+            *line = grow(*line, cap, len + restlen + 1, 1);
+            memmove(*line + len, *line + rest, restlen + 1);
+            memcpy(*line, histmap + histoff[n - 1], len);
+            printf("%s", *line);
+            return 1;
+    }
+
+    /* histprint - Print entry n the way history lists it */
+    static void histprint(size_t n) {
+            printf("%5zu  %.*s\n", n, (int)histlen(n), histmap + histoff[n - 1]);
+    }
+
+    /*
+     * do_history - List the last n entries, or all of them, or with -s
+     *    those containing text, oldest first. -s is a plain memmem over
+     *    the mapping, with no index of its own: a million entries take
+     *    about 7 ms, while a suffix array would take four times the file
+     *    in memory and an n-gram index would have to be kept up as other
+     *    shells append. The tree only serves prefixes.
+     */
+    void do_history(char **argv) {
+            size_t n = 1, lo, hi, mid;
+            char *p, *hit, *end;
+            long k;
+
+            histsync(SIZE_MAX);
+            if (argv[1] != NULL && strcmp(argv[1], "-s") == 0 && argv[2] != NULL && argv[3] == NULL) {
+        end = histmap + histindexed;
+        for (p = histmap; p < end && (hit = memmem(p, end - p, argv[2], strlen(argv[2]))) != NULL; ) {
+                /* The hit is in the last entry that starts at or before it */
+                for (lo = 0, hi = nhist; hi - lo > 1; ) {
+                        mid = (lo + hi) / 2;
+                        if (histmap + histoff[mid] <= hit)
+                                lo = mid;
+                        else
+                                hi = mid;
+                }
+                histprint(lo + 1);
+                p = histmap + histoff[lo] + histlen(lo + 1) + 1;
+        }
+        return;
+            }
+            if (argv[1] != NULL) {
+        k = strtol(argv[1], &p, 10);
+        if (*p != '\0' || k < 0 || argv[2] != NULL) {
+                printf("history: usage: history [n] | history -s text\n");
+                laststatus = 2;
+                return;
+        }
+        if ((size_t)k < nhist)
+                n = nhist - k + 1;
+            }
+            for (; n <= nhist; n++)
+        histprint(n);
+    }
+
+    /***************************************
+     * Helper routines for glob expansion
+     ***************************************/
+
+    /*
+     * A word with a bare *, ? or [ in it is a pattern. parseline puts the
+     * paths it matches in its place, or leaves it as it is if nothing
+     * matches. * matches any run of characters, ? any one, and [...] any
+     * one of a set, or with [!...] or [^...] any one not in it. A quoted
+     * or escaped character matches only itself. None of them match a /
+     * or a leading dot. A ** standing alone as a path component matches
+     * any number of directories, none included, so src, ** and *.c as
+     * components find the C files anywhere under src. At the end of a
+     * pattern it matches everything below. Matches come out sorted in
+     * byte order.
+     *
+     * Directories are read with getdents64 a GLOBBATCH at a time. Their
+     * listings are cached across commands, keyed by path, and used
+     * again while the directory has the same inode and mtime. A listing
+     * taken within a clock tick of the mtime is read again next time,
+     * since a change in that same tick would leave the mtime as it was.
+     * A listing just read is left in directory order, and only the
+     * matches are sorted, as most patterns match few names; it is
+     * sorted the first time it is used again. So a pattern over a big
+     * directory costs one stat and a pass over the names in memory, or
+     * for one that starts with literal bytes, like f00012*, a binary
+     * search and a pass over the names that start with them. Each
+     * component of a pattern is compiled into runs of literal bytes, ?,
+     * * and sets, and one that ends in a literal, like *.bin, checks
+     * that end first. The cache
+     * holds about GLOBCACHEMAX bytes; past that the oldest listings are
+     * dropped before the next line is expanded.
+     */
+    #define GLOBBATCH (1 << 20)         /* bytes asked of getdents64 at once */
+    #define GLOBCACHEMAX (256 << 20)    /* bytes of listings kept */
+    #define GLOBHASH 1024               /* buckets of the listing cache */
+
+    struct globent_t {              /* One name in a listing */
+            unsigned off;           /* where it starts in names */
+            unsigned char len;      /* a name is at most NAME_MAX long */
+            unsigned char type;     /* its d_type */
+    };
+    struct globdir_t {              /* A directory's cached listing */
+            char *path;             /* as opened; "" is the current directory */
+            dev_t dev;
+            ino_t ino;
+            struct timespec mtime;  /* its mtime when it was read */
+            int racy;               /* read within a tick of it: read again */
+            unsigned gen;           /* the last expansion that checked it */
+            char *names;            /* the names, each NUL-terminated */
+            struct globent_t *ents;
+            int sorted;             /* ents are sorted by name */
+            size_t nents, size;     /* size is the bytes held, for GLOBCACHEMAX */
+            struct globdir_t *next; /* next in the same bucket */
+            struct globdir_t *newer; /* next one read after it */
+    };
+    static struct globdir_t *globdirs[GLOBHASH], *globoldest, *globnewest;
+    static size_t globcached;       /* bytes held by all the listings */
+    static unsigned globgen;        /* counts the lines expanded */
+    static int globunsorted;        /* an unsorted listing was walked */
+
+    /* globent_cmp - qsort comparator for a listing, by name */
+    static const char *globsorting;
+    static int globent_cmp(const void *a, const void *b) {
+            return strcmp(globsorting + ((const struct globent_t *)a)->off,
+                          globsorting + ((const struct globent_t *)b)->off);
+    }
+
+    /* globname_cmp - qsort comparator for the offsets of paths in globsorting */
+    static int globname_cmp(const void *a, const void *b) {
+            return strcmp(globsorting + *(const size_t *)a, globsorting + *(const size_t *)b);
+    }
+
+    /* globhash - Bucket of the listing cache for path */
+    static struct globdir_t **globhash(const char *path) {
+            unsigned h = 2166136261u;
+
+            for (; *path; path++)
+        h = (h ^ (unsigned char)*path) * 16777619u;
+            return &globdirs[h & (GLOBHASH - 1)];
+    }
+
+    /* globfree - Drop a listing's names, keeping the rest */
+    static void globfree(struct globdir_t *d) {
+            globcached -= d->size;
+            free(d->names);
+            free(d->ents);
+            d->names = NULL;
+            d->ents = NULL;
+            d->nents = d->size = 0;
+            d->sorted = 0;
+    }
+
+    /* globread - Read the directory d->path into d; -1 if it can't be */
+    static int globread(struct globdir_t *d) {
+            static char *batch;
+            struct timespec now, res;
+            struct dirent64 *de;
+            struct stat st;
+            size_t namelen = 0, namecap = 0, entcap = 0, len;
+            long n, off;
+            int fd;
+
+            globfree(d);
+            if ((fd = open(*d->path ? d->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+            if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+            }
+            if (batch == NULL && (batch = malloc(GLOBBATCH)) == NULL)
+        unix_error("malloc error");
+            while ((n = syscall(SYS_getdents64, fd, batch, GLOBBATCH)) > 0) {
+        for (off = 0; off < n; off += de->d_reclen) {
+                de = (struct dirent64 *)(batch + off);
+                if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+                                             (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+                        continue;
+                len = strlen(de->d_name);
+                d->names = grow(d->names, &namecap, namelen + len + 1, 1);
+                d->ents = grow(d->ents, &entcap, d->nents + 1, sizeof(*d->ents));
+                d->ents[d->nents++] = (struct globent_t){namelen, len, de->d_type};
+                memcpy(d->names + namelen, de->d_name, len + 1);
+                namelen += len + 1;
+        }
+            }
+            close(fd);
+            if (d->names == NULL)           /* empty, but read */
+        d->names = grow(NULL, &namecap, 1, 1);
+            d->dev = st.st_dev;
+            d->ino = st.st_ino;
+            d->mtime = st.st_mtim;
+            clock_gettime(CLOCK_REALTIME_COARSE, &now);
+            clock_getres(CLOCK_REALTIME_COARSE, &res);
+            d->racy = (now.tv_sec - st.st_mtim.tv_sec) * 1000000000LL + now.tv_nsec - st.st_mtim.tv_nsec <=
+                      res.tv_sec * 1000000000LL + res.tv_nsec;
+            d->size = namecap + entcap * sizeof(*d->ents);
+            globcached += d->size;
+            return 0;
+    }
+
+    /* globlisting - The listing of the directory path, from the cache while it is good; NULL if none */
+    static struct globdir_t *globlisting(const char *path) {
+            struct globdir_t *d, **b = globhash(path);
+            struct stat st;
+
+            for (d = *b; d != NULL && strcmp(d->path, path) != 0; d = d->next)
+        ;
+            if (d == NULL) {
+        if ((d = calloc(1, sizeof(*d))) == NULL || (d->path = strdup(path)) == NULL)
+                unix_error("malloc error");
+        d->next = *b;
+        *b = d;
+        if (globnewest != NULL)
+                globnewest->newer = d;
+        else
+                globoldest = d;
+        globnewest = d;
+            }
+            else if (d->gen == globgen)     /* checked already for this line */
+        return d->names != NULL ? d : NULL;
+            else if (!d->racy && d->names != NULL && stat(*path ? path : ".", &st) == 0 &&
+                     st.st_dev == d->dev && st.st_ino == d->ino &&
+                     st.st_mtim.tv_sec == d->mtime.tv_sec && st.st_mtim.tv_nsec == d->mtime.tv_nsec) {
+        d->gen = globgen;
+        if (!d->sorted) {               /* used again, so worth sorting */
+                globsorting = d->names;
+                qsort(d->ents, d->nents, sizeof(*d->ents), globent_cmp);
+                d->sorted = 1;
+        }
+        return d;
+            }
+            d->gen = globgen;
+            return globread(d) == 0 ? d : NULL;
+    }
+
+    /* globtrim - Drop the oldest listings while the cache holds too much */
+    static void globtrim(void) {
+            struct globdir_t *d, **p;
+
+            while (globcached > GLOBCACHEMAX && (d = globoldest) != NULL) {
+        for (p = globhash(d->path); *p != d; p = &(*p)->next)
+                ;
+        *p = d->next;
+        if ((globoldest = d->newer) == NULL)
+                globnewest = NULL;
+        globfree(d);
+        free(d->path);
+        free(d);
+            }
+    }
+
+    enum { G_LIT, G_ANY, G_SET, G_STAR };
+    struct globtok_t {              /* One step of a compiled component */
+            unsigned char type;
+            unsigned short len;     /* of a literal run */
+            unsigned at;            /* where its bytes are in lit, or which set */
+    };
+    struct globseg_t {              /* One path component of a pattern, compiled */
+            int wild;               /* has a wildcard; else it is just its literal */
+            int deep;               /* is ** */
+            int dot;                /* starts with a literal dot */
+            struct globtok_t *toks;
+            int ntoks;
+            const char *lit;        /* its literal bytes */
+            size_t litlen;
+            size_t minlen;          /* no shorter name can match */
+            int exact;              /* has no *, so a match is minlen long */
+            size_t suffix;          /* length of the literal run after its last * */
+    };
+    struct globwalk_t {             /* A pattern being matched */
+            struct globseg_t *segs;
+            int nsegs;
+            struct cmd_t *cmd;      /* where the matches go */
+    };
+    /* Room for the compiled pattern, grown to fit the longest one */
+    static struct globseg_t *globsegs;
+    static struct globtok_t *globtoks;
+    static char *globlit;
+    static unsigned char (*globsets)[32];
+    static size_t globsegcap, globtokcap, globlitcap, globsetcap;
+    static char *globpath;          /* the path being walked */
+    static size_t globpathcap;
+
+    /*
+     * globcompile - Compile the component p[0..n) of a pattern into g,
+     *    with its steps at globtoks[*ntoks], its literal bytes at
+     *    globlit[*nlit] and its sets at globsets[*nsets], and move each
+     *    count past what it used
+     */
+    static void globcompile(const char *p, size_t n, struct globseg_t *g,
+                            size_t *ntoks, size_t *nlit, size_t *nsets) {
+            const char *end = p + n, *close;
+            struct globtok_t *t = NULL;
+            unsigned char *set;
+            int neg, c, lo;
+
+            memset(g, 0, sizeof(*g));
+            g->toks = &globtoks[*ntoks];
+            g->lit = &globlit[*nlit];
+            g->deep = n == 2 && p[0] == '*' && p[1] == '*';
+            g->exact = 1;
+            while (p < end) {
+        if (*p == '*') {
+                if (t == NULL || t->type != G_STAR) {
+                        t = &g->toks[g->ntoks++];
+                        t->type = G_STAR;
+                }
+                g->wild = 1;
+                g->exact = 0;
+                p++;
+                continue;
+        }
+        if (*p == '?') {
+                t = &g->toks[g->ntoks++];
+                t->type = G_ANY;
+                g->wild = 1;
+                g->minlen++;
+                p++;
+                continue;
+        }
+        if (*p == '[') {
+                /* A set needs its ], which may be its first member */
+                neg = p + 1 < end && (p[1] == '!' || p[1] == '^');
+                for (close = p + 2 + neg; close < end && *close != ']'; close++)
+                        if (*close == '\\' && close + 1 < end)
+                                close++;
+                if (close < end) {
+                        t = &g->toks[g->ntoks++];
+                        t->type = G_SET;
+                        t->at = *nsets;
+                        set = globsets[(*nsets)++];
+                        memset(set, 0, 32);
+                        for (p += 1 + neg; p < close; p++) {
+                                if (*p == '\\' && p + 1 < close)
+                                        p++;
+                                lo = c = (unsigned char)*p;
+                                if (p + 2 < close && p[1] == '-') {
+                                        p += 2;
+                                        if (*p == '\\' && p + 1 < close)
+                                                p++;
+                                        c = (unsigned char)*p;
+                                }
+                                for (; lo <= c; lo++)
+                                        set[lo >> 3] |= 1 << (lo & 7);
+                        }
+                        if (neg)
+                                for (c = 0; c < 32; c++)
+                                        set[c] ^= 0xff;
+                        set['/' >> 3] &= ~(1 << ('/' & 7));
+                        g->wild = 1;
+                        g->minlen++;
+                        p = close + 1;
+                        continue;
+                }
+        }
+        if (*p == '\\' && p + 1 < end)
+                p++;
+        if (t == NULL || t->type != G_LIT) {
+                t = &g->toks[g->ntoks++];
+                t->type = G_LIT;
+                t->len = 0;
+                t->at = g->litlen;
+        }
+        globlit[(*nlit)++] = *p++;
+        g->litlen++;
+        t->len++;
+        g->minlen++;
+            }
+            globlit[(*nlit)++] = '\0';
+            g->dot = g->ntoks > 0 && g->toks[0].type == G_LIT && g->lit[0] == '.';
+            if (g->ntoks >= 2 && t->type == G_LIT && g->toks[g->ntoks - 2].type == G_STAR)
+        g->suffix = t->len;
+            *ntoks += g->ntoks;
+    }
+
+    /* globmatch - True if the name s, n bytes long, matches the component g */
+    static int globmatch(const struct globseg_t *g, const char *s, size_t n) {
+            const struct globtok_t *t = g->toks, *end = t + g->ntoks, *star = NULL;
+            size_t i = 0, retry = 0;
+            int c;
+
+            if (n < g->minlen || (g->exact && n != g->minlen) ||
+                (g->suffix && memcmp(s + n - g->suffix, g->lit + g->litlen - g->suffix, g->suffix) != 0))
+        return 0;
+            while (t < end || i < n) {
+        if (t < end) {
+                if (t->type == G_STAR) {
+                        star = t++;
+                        retry = i;
+                        continue;
+                }
+                if (t->type == G_LIT && i + t->len <= n && memcmp(s + i, g->lit + t->at, t->len) == 0) {
+                        i += t->len;
+                        t++;
+                        continue;
+                }
+                c = (unsigned char)s[i];
+                if (i < n && (t->type == G_ANY ||
+                              (t->type == G_SET && globsets[t->at][c >> 3] & 1 << (c & 7)))) {
+                        i++;
+                        t++;
+                        continue;
+                }
+        }
+        /* Let the last * take one more character, and go on from there */
+        if (star == NULL || retry >= n)
+                return 0;
+        t = star + 1;
+        i = ++retry;
+            }
+            return 1;
+    }
+
+    /* globemit - Add the len bytes of globpath to the words the pattern expands to */
+    static void globemit(struct globwalk_t *w, size_t len) {
+            struct cmd_t *cmd = w->cmd;
+
+            cmd->names = grow(cmd->names, &cmd->namecap, cmd->namelen + len + 1, 1);
+            cmd->nameoff = grow(cmd->nameoff, &cmd->nameoffcap, cmd->nnames + 1, sizeof(size_t));
+            memcpy(cmd->names + cmd->namelen, globpath, len);
+            cmd->names[cmd->namelen + len] = '\0';
+            cmd->nameoff[cmd->nnames++] = cmd->namelen;
+            cmd->namelen += len + 1;
+    }
+
+    /* globjoin - Put name after the directory in globpath[0..len); returns the new length */
+    static size_t globjoin(size_t len, const char *name, size_t n) {
+            globpath = grow(globpath, &globpathcap, len + n + 2, 1);
+            if (len > 0 && globpath[len - 1] != '/')
+        globpath[len++] = '/';
+            memcpy(globpath + len, name, n);
+            globpath[len + n] = '\0';
+            return len + n;
+    }
+
+    /*
+     * globwalk - Match component i of the pattern, and those after it, in
+     *    the directory globpath[0..len): below if a ** above brought us
+     */
+    static void globwalk(struct globwalk_t *w, size_t len, int i, int below) {
+            struct globseg_t *g = &w->segs[i];
+            int last = i == w->nsegs - 1;
+            struct globdir_t *d;
+            struct globent_t *e;
+            struct stat st;
+            size_t j, n, lo, hi, pre = 0;
+            const char *prefix = NULL;
+            char *name;
+
+            if (!g->wild) {                 /* a plain name needs no listing */
+        n = globjoin(len, g->lit, g->litlen);
+        if (!last)
+                globwalk(w, n, i + 1, 0);
+        else if (lstat(globpath, &st) == 0)
+                globemit(w, n);
+        return;
+            }
+            if (g->deep && !last)           /* ** as no directories at all */
+        globwalk(w, len, i + 1, 0);
+            else if (g->deep && len > 0 && !below)  /* at the end, the directory itself */
+        globemit(w, globjoin(len, "", 0));
+            globpath[len] = '\0';
+            if ((d = globlisting(globpath)) == NULL)
+        return;
+            j = 0;
+            if (!d->sorted)
+        globunsorted = 1;
+            else if (!g->deep && g->toks[0].type == G_LIT) {
+        /* Only the names from the first one with its leading literal on */
+        prefix = g->lit;
+        pre = g->toks[0].len;
+        for (lo = 0, hi = d->nents; lo < hi; ) {
+                j = lo + (hi - lo) / 2;
+                if (strncmp(d->names + d->ents[j].off, prefix, pre) < 0)
+                        lo = j + 1;
+                else
+                        hi = j;
+        }
+        j = lo;
+            }
+            for (; j < d->nents; j++) {
+        e = &d->ents[j];
+        name = d->names + e->off;
+        if (prefix != NULL && strncmp(name, prefix, pre) != 0)
+                break;
+        if (name[0] == '.' && !g->dot)
+                continue;
+        if (g->deep) {
+                n = globjoin(len, name, e->len);
+                if (last)
+                        globemit(w, n);
+                if (e->type == DT_DIR || (e->type == DT_UNKNOWN && lstat(globpath, &st) == 0 &&
+                                          S_ISDIR(st.st_mode)))
+                        globwalk(w, n, i, 1);
+                continue;
+        }
+        if (!globmatch(g, name, e->len))
+                continue;
+        n = globjoin(len, name, e->len);
+        if (last)
+                globemit(w, n);
+        else if (e->type == DT_DIR || e->type == DT_LNK || e->type == DT_UNKNOWN)
+                globwalk(w, n, i + 1, 0);
+            }
+    }
+
+    /*
+     * globexpand - Add the paths that match pat, a pattern with quoted
+     *    characters escaped, to cmd's names. Returns how many there are,
+     *    or 0 if there are none or pat has no wildcards after all.
+     */
+    static size_t globexpand(const char *pat, struct cmd_t *cmd) {
+            struct globwalk_t w = {NULL, 0, cmd};
+            size_t n = strlen(pat), ntoks = 0, nlit = 0, nsets = 0, before = cmd->nnames;
+            const char *p, *slash;
+            int wild = 0;
+
+            globsegs = grow(globsegs, &globsegcap, n + 2, sizeof(*globsegs));
+            globtoks = grow(globtoks, &globtokcap, n + 1, sizeof(*globtoks));
+            globlit = grow(globlit, &globlitcap, 2 * n + 2, 1);
+            globsets = grow(globsets, &globsetcap, n / 3 + 1, sizeof(*globsets));
+            globpath = grow(globpath, &globpathcap, 2, 1);
+            w.segs = globsegs;
+            p = pat;
+            if (*p == '/') {                /* an absolute pattern starts at / */
+        strcpy(globpath, "/");
+        p++;
+            }
+            while (1) {
+        slash = strchrnul(p, '/');
+        globcompile(p, slash - p, &globsegs[w.nsegs], &ntoks, &nlit, &nsets);
+        wild += globsegs[w.nsegs].wild + globsegs[w.nsegs].deep;
+        w.nsegs++;
+        if (*slash == '\0')
+                break;
+        p = slash + 1;
+            }
+            if (!wild)
+        return 0;
+            globunsorted = 0;
+            globwalk(&w, *pat == '/', 0, 0);
+
+            /* One sorted listing gives sorted paths; several, or one just read, don't */
+            if (wild > 1 || globunsorted) {
+        globsorting = cmd->names;
+        qsort(cmd->nameoff + before, cmd->nnames - before, sizeof(size_t), globname_cmp);
+            }
+            return cmd->nnames - before;
+    }
+
+    /*
+     * globpattern - Copy the word that was typed as start[0..end) to out
+     *    as a pattern: the quotes and escapes go, as in parseline, but
+     *    each character they kept but / gets a backslash, so only the
+     *    bare *, ? and [ are wildcards
+     */
+    static void globpattern(const char *start, const char *end, char *out) {
+            const char *p = start;
+            char q = 0;                     /* the quote we are in, if any */
+
+            for (; p < end; p++) {
+        if (q == 0 && (*p == '\'' || *p == '"')) {
+                q = *p;
+                continue;
+        }
+        if (*p == q) {
+                q = 0;
+                continue;
+        }
+        if (*p == '\\' && q != '\'') {
+                if (q == '"' && (p + 1 == end || strchr("\\\"$`\n", p[1]) == NULL)) {
+                        *out++ = '\\';          /* kept, in double quotes */
+                        *out++ = '\\';
+                        continue;
+                }
+                if (++p == end || *p == '\n')
+                        continue;
+                if (*p != '/')
+                        *out++ = '\\';
+                *out++ = *p;
+                continue;
+        }
+        if ((q != 0 && *p != '/') || *p == '\\')
+                *out++ = '\\';       /* a / is never a wildcard, and splits components */
+        *out++ = *p;
+            }
+            *out = '\0';
+    }
+
+    /*
+     * globwords - Put the paths each pattern word of cmd matches in its
+     *    place in argv, which has *argc words, moving the starts of the
+     *    stages in first[0..nstages] to suit. Returns the new argv.
+     */
+    char **globwords(struct cmd_t *cmd, const char *cmdline, size_t *argc, size_t *first, int nstages)
+    {
+            struct globword_t *gw;
+            size_t i, j, k, total = *argc, cap;
+            char **argv = cmd->argv, **out;
+            int s = 0;
+
+            globgen++;
+            globtrim();
+            cmd->nnames = cmd->namelen = 0;
+            for (gw = cmd->globs; gw < cmd->globs + cmd->nglobs; gw++) {
+        gw->first = cmd->nnames;
+        if (gw->quoted) {
+                cmd->pattern = grow(cmd->pattern, &cmd->patterncap, 2 * (gw->end - gw->start) + 1, 1);
+                globpattern(cmdline + gw->start, cmdline + gw->end, cmd->pattern);
+                gw->count = globexpand(cmd->pattern, cmd);
+        }
+        else
+                gw->count = globexpand(argv[gw->arg], cmd);
+        if (gw->count > 0)
+                total += gw->count - 1;
+            }
+
+            out = cmd->gargv = grow(cmd->gargv, &cmd->gargcap, total + 1, sizeof(char *));
+            for (i = j = 0, gw = cmd->globs; i < *argc; i++) {
+        while (s <= nstages && first[s] == i)
+                first[s++] = j;
+        if (gw < cmd->globs + cmd->nglobs && gw->arg == i) {
+                for (k = 0; k < gw->count; k++)
+                        out[j++] = cmd->names + cmd->nameoff[gw->first + k];
+                if (gw++->count > 0)
+                        continue;
+        }
+        out[j++] = argv[i];
+            }
+            while (s <= nstages)            /* an empty last stage, an error to come */
+        first[s++] = j;
+            out[j] = NULL;
+            *argc = j;
+
+            /* Keep the old argv for the next line that needs one */
+            cmd->gargv = argv;
+            cap = cmd->gargcap;
+            cmd->gargcap = cmd->argcap;
+            cmd->argcap = cap;
+            return cmd->argv = out;
+    }
+
+    /***************************************
+     * Helper routines for the job server
+     ***************************************/
+
+    /*
+     * With -S path the shell reads no commands of its own but serves
+     * any number of clients on a Unix domain socket, all from the one
+     * epoll loop that also watches the children. Each line a client
+     * sends is run as if typed, except that a job always starts in the
+     * background: there is no terminal to give it. What the shell
+     * prints for the line comes back to that client as one frame,
+     *
+     *     <length> <status>\n<length bytes of output>
+     *
+     * where status is laststatus once the line has run: 0 for a job that
+     * started, 127 for a command not found. Replies go out in the order
+     * the lines came in, so a client may send many before it reads any.
+     * The jobs' own output, and the reports of jobs that end or stop, go
+     * to the server's stdout. bg, kill and jobs work as typed, but fg,
+     * wait and parallel would block the one loop and hold every other
+     * client up, and a client has no terminal to bring a job to, so
+     * they are refused with "<name>: not available to job server
+     * clients" and status 2.
+     */
+
+    /* closeclient - Hang up on a client and free its slot */
+    static void closeclient(struct client_t *c) {
+            close(c->fd);       /* which takes it out of the epoll set */
+            free(c->in);
+            free(c->out);
+            memset(c, 0, sizeof(*c));
+            c->fd = -1;
+    }
+
+    /*
+     * acceptclients - Take every connection waiting on the socket, then
+     *    rearm it
+     */
+    static void acceptclients(void) {
+            struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.u64 = 0}};
+            size_t slot;
+            int fd;
+
+            while ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        for (slot = 0; slot < nclients && clients[slot].fd >= 0; slot++)
+                ;
+        if (slot == nclients)
+                clients = grow(clients, &clientcap, ++nclients, sizeof(*clients));
+        memset(&clients[slot], 0, sizeof(*clients));
+        clients[slot].fd = fd;
+        ev.data.u64 = EP_CLIENT + slot;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                unix_error("epoll_ctl error");
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+        printf("tsh: accept: %s\n", strerror(errno));
+            ev.data.u64 = EP_LISTEN;
+            if (epoll_ctl(epfd, EPOLL_CTL_MOD, listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    }
+
+    /*
+     * reply - Run one line for a client, with stdout collecting what
+     *    is printed, and queue the frame holding it
+     */
+    static void reply(struct client_t *c, char *line) {
+            FILE *out = stdout;
+            char *text = NULL, head[32];
+            size_t len = 0;
+            int n;
+
+            if ((stdout = open_memstream(&text, &len)) == NULL)
+        unix_error("open_memstream error");
+            stdout0 = out;
+            laststatus = 0;
+            eval(line);
+            fclose(stdout);
+            stdout = out;
+            stdout0 = NULL;
+
+            n = snprintf(head, sizeof(head), "%zu %d\n", len, laststatus);
+            c->out = grow(c->out, &c->outcap, c->outlen + n + len, 1);
+            memcpy(c->out + c->outlen, head, n);
+            memcpy(c->out + c->outlen + n, text, len);
+            c->outlen += n + len;
+            free(text);
+    }
+
+    /*
+     * serveclient - Read what a client has sent and run each whole
+     *    line, then write as much of the replies as the socket takes.
+     *    While replies are still queued nothing more is read, so a
+     *    client that doesn't read them can't make the server buffer
+     *    without bound. The client is closed once it has hung up and
+     *    been answered, or on an error; otherwise it is rearmed for
+     *    reading, or for writing if replies are still queued.
+     */
+    static void serveclient(struct client_t *c, size_t slot) {
+            struct epoll_event ev = {EPOLLONESHOT, {.u64 = EP_CLIENT + slot}};
+            size_t start = 0;
+            ssize_t n;
+            char *nl, saved;
+
+            if (c->outoff == c->outlen && !c->eof) {
+        /* One read a turn, so a busy client can't starve the rest */
+        c->in = grow(c->in, &c->incap, c->inlen + (1<<16), 1);
+        if ((n = read(c->fd, c->in + c->inlen, (1<<16) - 1)) > 0)
+                c->inlen += n;
+        else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                c->eof = 1;
+
+        while ((nl = memchr(c->in + start, '\n', c->inlen - start)) != NULL) {
+                saved = nl[1];          /* there is always a byte to spare */
+                nl[1] = '\0';
+                reply(c, c->in + start);
+                nl[1] = saved;
+                start = nl + 1 - c->in;
+        }
+        memmove(c->in, c->in + start, c->inlen - start);
+        c->inlen -= start;
+        if (c->inlen >= linemax()) {    /* could never be run */
+                printf("tsh: client line too long\n");
+                c->eof = 1;
+        }
+            }
+
+            while (c->outoff < c->outlen) {
+        if ((n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL)) > 0)
+                c->outoff += n;
+        else if (errno == EAGAIN || errno == EINTR)
+                break;
+        else {
+                closeclient(c);         /* it isn't listening any more */
+                return;
+        }
+            }
+            if (c->outoff == c->outlen)
+        c->outoff = c->outlen = 0;
+            else
+        ev.events |= EPOLLOUT;
+
+            if (c->eof && c->outlen == 0)
+        closeclient(c);
+            else {
+        if (!(ev.events & EPOLLOUT))
+                ev.events |= EPOLLIN;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+                unix_error("epoll_ctl error");
+            }
+    }
+
+    /* unlinksock - Remove the server's socket at exit */
+    static void unlinksock(void) {
+            unlink(sockpath);
+    }
+
+    /*
+     * runserver - Serve clients on the Unix domain socket path, until
+     *    one of them sends quit. A socket left there by a server that
+     *    was killed is replaced.
+     */
+    void runserver(char *path) {
+            struct sockaddr_un addr = {AF_UNIX, {0}};
+            struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.u64 = EP_LISTEN}};
+            struct stat st;
+            size_t i;
+            int fd;
+
+            if (strlen(path) >= sizeof(addr.sun_path))
+        app_error("tsh: socket path too long");
+            strcpy(addr.sun_path, path);
+            if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+            if ((listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+                bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        unix_error(path);
+            sockpath = path;
+            atexit(unlinksock);
+            if (listen(listenfd, SOMAXCONN) < 0)
+        unix_error("listen error");
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+            /* Jobs read nothing: the shell's stdin is no longer anyone's */
+            if ((fd = open("/dev/null", O_RDONLY)) >= 0) {
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+            }
+
+            while (1) {
+        handlesignals();        /* report jobs that have ended */
+        fflush(stdout);
+        waitinput(-1);
+        handlesignals();
+        if (listenready) {
+                listenready = 0;
+                acceptclients();
+        }
+        for (i = 0; i < nclients; i++)
+                if (clients[i].ready) {
+                        clients[i].ready = 0;
+                        serveclient(&clients[i], i);
+                }
+            }
+    }
+
+    /***************************************
+     * Helper routines for the event trace
+     ***************************************/
+
+    /* tracenow - The trace clock in ns, or 0 when tracing is off */
+    long long tracenow(void) {
+            struct timespec ts;
+
+            if (!tracing)
+        return 0;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    /*
+     * traceevent - Record an event in the ring: a span (EV_PARSE up to
+     *    EV_WAIT) from start, the tracenow() taken when it began, or an
+     *    instant. Uses nothing but clock_gettime and an atomic add, so
+     *    handlers may call it.
+     */
+    void traceevent(int type, long long start, pid_t pid, int arg) {
+            struct event_t *ev;
+            struct timespec ts;
+            long long now;
+
+            if (type <= EV_WAIT && start == 0)
+        return;         /* began before tracing was turned on */
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            ev = &trace[__atomic_fetch_add(&ntrace, 1, __ATOMIC_RELAXED) & (TRACESIZE - 1)];
+            ev->ts = type <= EV_WAIT ? start : now;
+            ev->dur = type <= EV_WAIT ? now - start : -1;
+            ev->type = type;
+            ev->pid = pid;
+            ev->arg = arg;
+    }
+
+    /*
+     * dumptrace - Write the ring to file as Chrome trace JSON, which
+     *    chrome://tracing and ui.perfetto.dev load. The shell's own work
+     *    is on its own thread track; stops and reaps go on a track per
+     *    child, and jobs are async spans from addjob to removejob.
+     *    Returns 0, or -1 if the file could not be written.
+     */
+    int dumptrace(char *file) {
+            static char *names[] = {"parse", "builtin", "spawn", "fork", "setpgid",
+                                    "waitfg", "stop", "continue", "reap", "signal",
+                                    "job", "job"};
+            static char *args[] = {NULL, NULL, NULL, NULL, "pgid", NULL, "sig",
+                                   "jid", "status", "sig", "jid", "jid"};
+            unsigned long i, first;
+            sigset_t mask, prev;
+            struct event_t *ev;
+            pid_t self = getpid();
+            FILE *fp;
+            int err;
+
+            if ((fp = fopen(file, "w")) == NULL) {
+        printf("trace: %s: %s\n", file, strerror(errno));
+        return -1;
+            }
+            sigemptyset(&mask);
+            sigaddset(&mask, SIGCHLD);
+            sigaddset(&mask, SIGINT);
+            sigaddset(&mask, SIGTSTP);
+            sigprocmask(SIG_BLOCK, &mask, &prev);
+
+            fprintf(fp, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\","
+                    "\"pid\":%d,\"args\":{\"name\":\"tsh\"}}", self);
+            first = ntrace > TRACESIZE ? ntrace - TRACESIZE : 0;
+            for (i = first; i < ntrace; i++) {
+        ev = &trace[i & (TRACESIZE - 1)];
+        fprintf(fp, ",\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+                names[ev->type], self,
+                ev->type == EV_STOP || ev->type == EV_REAP ? ev->pid : self, ev->ts / 1e3);
+        if (ev->type == EV_JOBSTART || ev->type == EV_JOBEND)
+                fprintf(fp, ",\"ph\":\"%c\",\"cat\":\"job\",\"id\":%d",
+                        ev->type == EV_JOBSTART ? 'b' : 'e', ev->arg);
+        else if (ev->dur >= 0)
+                fprintf(fp, ",\"ph\":\"X\",\"dur\":%.3f", ev->dur / 1e3);
+        else
+                fprintf(fp, ",\"ph\":\"i\",\"s\":\"t\"");
+        if (ev->pid != 0) {
+                fprintf(fp, ",\"args\":{\"pid\":%d", ev->pid);
+                if (args[ev->type] != NULL)
+                        fprintf(fp, ",\"%s\":%d", args[ev->type], ev->arg);
+                fprintf(fp, "}");
+        }
+        fprintf(fp, "}");
+            }
+            fprintf(fp, "\n]}\n");
+
+            sigprocmask(SIG_SETMASK, &prev, NULL);
+            err = ferror(fp);
+            if (fclose(fp) != 0 || err) {
+        printf("trace: %s: write error\n", file);
+        return -1;
+            }
+            return 0;
+    }
+
+    /* tracexit - Write the trace named by -t when the shell exits */
+    void tracexit(void) {
+            dumptrace(tracefile);
+    }
+
+    /*
+     * do_trace - Execute the builtin trace command
+     *    trace          say whether tracing is on and what the ring holds
+     *    trace on|off   start or stop recording events
+     *    trace clear    forget the events recorded so far
+     *    trace FILE     write the events to FILE as Chrome trace JSON
+     */
+    void do_trace(char **argv) {
+            sigset_t mask, prev;
+
+            if (argv[1] == NULL) {
+        printf("trace: %s, %lu events\n", tracing ? "on" : "off",
+               ntrace < TRACESIZE ? ntrace : TRACESIZE);
+            }
+            else if (strcmp(argv[1], "on") == 0)
+        tracing = 1;
+            else if (strcmp(argv[1], "off") == 0)
+        tracing = 0;
+            else if (strcmp(argv[1], "clear") == 0) {
+        sigfillset(&mask);
+        sigprocmask(SIG_BLOCK, &mask, &prev);
+        ntrace = 0;
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+            }
+            else
+        dumptrace(argv[1]);
+    }
+
     /***********************
      * Other helper routines
      ***********************/
@@ -807,10 +5347,16 @@ void listjobs(struct job_t *jobs){
      * usage - print a help message
      */
     void usage(void){
-            printf("Usage: shell [-hvp]\n");
+            printf("Usage: shell [-hvpf] [-t file] [-c command | script | -S path]\n");
             printf("   -h   print this message\n");
             printf("   -v   print additional diagnostic information\n");
-            printf("   -p   do not emit a command prompt\n");
+            printf("   -p   do not emit a command prompt, nor share the history file\n");
+            printf("   -f   launch jobs with fork+execve instead of posix_spawn\n");
+            printf("   -t   trace job events, and write them to file at exit\n");
+            printf("   -c   run the lines of command, then exit\n");
+            printf("   script  run the lines of the file script, then exit\n");
+            printf("   -S   serve commands from clients of the Unix socket path;\n");
+            printf("        fg, wait and parallel are refused to them\n");
             exit(1);
     }
 
@@ -0,0 +1,1564 @@
+/*
+ * tshbench.c - Latency and throughput benchmarks for the tiny shell
+ *
+ * usage: tshbench [-s <shell>] [-n <iters>] [-c <cmd>] [-m <MB,...>]
+ *                 [-z <size>] [-o <file>] <bench>
+ * The end-to-end benchmarks run the shell as a child connected by a
+ * pair of pipes, drive it with commands and report latency statistics
+ * in microseconds. The in-process benchmarks link in tsh.c and call
+ * its routines directly.
+ *
+ * Benchmarks:
+ *     prompt    Time from sending a short foreground command to the
+ *               next prompt, i.e. child exit -> waitfg -> prompt.
+ *     jobtable  Cost of addjob, getjobpid, getjobjid and deletejob
+ *               with 10, 1k and 100k jobs in the list (in-process).
+ *     joblist   Heap bytes per job, and the time "jobs" takes per job
+ *               listed, with 1k and 100k jobs in the list (in-process).
+ *     tokenize  Throughput of parseline over 10k generated command lines
+ *               of up to 1000 bytes, of plain words only, and with
+ *               quoted phrases, escapes and pipes (in-process).
+ *     spawn     Commands per second through launch() with fork+execvp
+ *               and with posix_spawn, and the latency from calling it
+ *               to the child's exec, with the process grown to each
+ *               RSS given by -m (default 2,200,2048 MB) (in-process).
+ *     pipeline  Throughput of -z bytes (default 10G) through the 3-stage
+ *               pipeline "head -c <size> /dev/zero | cat | wc -c", run
+ *               by the shell and, for reference, by /bin/sh.
+ *     parallel  Tasks per second through "parallel -j N <cmd> {}" over
+ *               -n arguments, for N = 1, the number of CPUs and 4x
+ *               that, with xargs -P N for reference.
+ *     batch     Lines per second through a 100k-line script of
+ *               builtins, and of builtins with every tenth line the
+ *               latency command, run as a script file and piped to
+ *               "tsh -p" on stdin.
+ *     reap      Start -n background children (default 10000 here),
+ *               kill them all at once and time how fast the shell
+ *               reaps and reports them; every job must be reported
+ *               exactly once, and none left on the job list.
+ *     bgdone    Time from killing one background job to its "terminated"
+ *               message while 5000 other background jobs stay live,
+ *               i.e. how quickly a completion is noticed and reported
+ *               with a large job list and epoll set.
+ *     builtins  Check the builtin dispatch table, then replay the lines
+ *               of trace01-16 that don't depend on timing as a script,
+ *               -n times over (default 20), with /bin/echo and with the
+ *               echo builtin; report the forks avoided and time saved.
+ *     server    Start the shell as a job server (-S) and have 64
+ *               clients connect at once and each submit -n lines, one
+ *               at a time, waiting for each reply: the true builtin,
+ *               for the server's own round trip, then the latency
+ *               command as a background job. Reports submissions per
+ *               second and the latency of each.
+ *     attrs     Foreground latency of the latency command (as prompt)
+ *               with the machine idle, then saturated by 2 background
+ *               "yes" per CPU: as they are, with on nice=19, and, with
+ *               more than one CPU, kept off CPU 0 with on cpus=.
+ *     deadlines Cost of setting and clearing job deadlines with 1k, 10k
+ *               and 100k of them pending (in-process), then start -n
+ *               jobs (default 2000 here) under "timeout 1" and time
+ *               how late each is reported killed by timeout.
+ *     signals   Time from ctrl-c and from ctrl-z reaching the shell to
+ *               the report that the foreground job was terminated or
+ *               stopped, i.e. sigint_handler/sigtstp_handler through
+ *               handlesignals to the reaper.
+ *     fanout    Keep 32 myfanout trees of 13 processes, which now and
+ *               then stop or interrupt themselves, running in the
+ *               background until -n of them (default 2000 here) have
+ *               ended, continuing stopped ones with bg; check every
+ *               tree's summary against the shell's reports and give
+ *               the jobs, processes and shell events per second.
+ *     history   Write a history of -n entries (default 1M here) and
+ *               time indexing it and prefix lookups in-process, then
+ *               shell startup with it against an empty one, the first
+ *               !prefix (which indexes it), later ones and a full
+ *               "history -s" scan.
+ *     glob      Make a directory of -n files (default 1M here) and time
+ *               parseline expanding patterns over it, the first time
+ *               after the directory changed and from the cache, against
+ *               bash expanding the same patterns (in-process).
+ *
+ * Pass -s to compare against another build of the shell, e.g. a copy
+ * of an older tsh kept as ./tsh.old, and -c to change the command the
+ * latency benchmarks run (default /bin/true). With -o each result is
+ * also appended to file as a line of JSON: the percentiles of a latency
+ * or a single figure such as a rate, so runs of different builds can
+ * be diffed or plotted. "make bench" runs the hot-path benchmarks this
+ * way into bench.json.
+ */
+#define _GNU_SOURCE             /* tsh.c needs it before any libc header */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <malloc.h>
+
+/*
+ * The in-process benchmarks call the shell's own routines, so build
+ * the shell into this program with its main() renamed out of the way.
+ */
+#define main tsh_main
+#include "tsh.c"
+#undef main
+
+#define MAXBUF 8192
+
+char *shell = "./tsh";          /* shell under test */
+int iters;                      /* samples per benchmark */
+char cmd[MAXBUF] = "/bin/true\n";  /* command run by latency benchmarks */
+char *rss_sizes = "2,200,2048";  /* RSS targets in MB for spawn */
+char *stream_size = "10G";      /* bytes pushed through pipeline */
+FILE *results;                  /* -o: where results go as JSON lines */
+char *benchname;                /* the benchmark being run, for results */
+
+struct shproc {                 /* a running shell under test */
+    pid_t pid;
+    int in;                     /* write end of the shell's stdin */
+    int out;                    /* read end of the shell's stdout */
+};
+
+/* now_us - Monotonic time in microseconds */
+double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* shell_start - Run the shell with its stdin and stdout on pipes */
+void shell_start(struct shproc *sh, char *args)
+{
+    int in[2], out[2];
+
+    if (pipe(in) < 0 || pipe(out) < 0) {
+	perror("pipe");
+	exit(1);
+    }
+    if ((sh->pid = fork()) == 0) {
+	dup2(in[0], 0);
+	dup2(out[1], 1);
+	close(in[0]); close(in[1]);
+	close(out[0]); close(out[1]);
+	execl(shell, shell, args, (char *)NULL);
+	perror(shell);
+	exit(1);
+    }
+    close(in[0]);
+    close(out[1]);
+    sh->in = in[1];
+    sh->out = out[0];
+}
+
+/* shell_stop - Close the shell's stdin and reap it */
+void shell_stop(struct shproc *sh)
+{
+    close(sh->in);
+    close(sh->out);
+    waitpid(sh->pid, NULL, 0);
+}
+
+/* shell_send - Write a command line to the shell */
+void shell_send(struct shproc *sh, char *line)
+{
+    size_t len = strlen(line);
+
+    if (write(sh->in, line, len) != (ssize_t)len) {
+	perror("write");
+	exit(1);
+    }
+}
+
+/* shell_expect - Read shell output until it ends with the string s */
+void shell_expect(struct shproc *sh, char *s)
+{
+    static char buf[MAXBUF];
+    size_t slen = strlen(s);
+    size_t len = 0;
+    ssize_t n;
+
+    while (1) {
+	if (len == MAXBUF - 1) {        /* keep only the tail */
+	    memmove(buf, buf + len - slen, slen);
+	    len = slen;
+	}
+	if ((n = read(sh->out, buf + len, MAXBUF - 1 - len)) <= 0) {
+	    fprintf(stderr, "shell exited before \"%s\"\n", s);
+	    exit(1);
+	}
+	len += n;
+	if (len >= slen && memcmp(buf + len - slen, s, slen) == 0)
+	    return;
+    }
+}
+
+/*
+ * shell_readline - Read one line of shell output into line, waiting at
+ * most ms for it. Returns its length, or -1 on timeout or end of file.
+ */
+int shell_readline(struct shproc *sh, char *line, int ms)
+{
+    static char buf[MAXBUF];
+    static int len;
+    struct pollfd pfd = {sh->out, POLLIN, 0};
+    char *nl;
+    ssize_t n;
+
+    while ((nl = memchr(buf, '\n', len)) == NULL) {
+	if (len == MAXBUF || poll(&pfd, 1, ms) <= 0 ||
+	    (n = read(sh->out, buf + len, MAXBUF - len)) <= 0)
+	    return -1;
+	len += n;
+    }
+    n = nl - buf + 1;
+    memcpy(line, buf, n);
+    line[n] = '\0';
+    memmove(buf, buf + n, len - n);
+    len -= n;
+    return n;
+}
+
+/* cmp_double - qsort comparator for samples */
+int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* report - Print summary statistics over n samples */
+void report(char *name, double *samples, int n)
+{
+    double sum = 0;
+    int i;
+
+    qsort(samples, n, sizeof(double), cmp_double);
+    for (i = 0; i < n; i++)
+	sum += samples[i];
+    printf("%-10s n=%d min=%.1f p50=%.1f p99=%.1f max=%.1f mean=%.1f us\n",
+	   name, n, samples[0], samples[n / 2], samples[(n * 99) / 100],
+	   samples[n - 1], sum / n);
+    if (results != NULL)
+	fprintf(results, "{\"bench\":\"%s\",\"name\":\"%s\",\"unit\":\"us\",\"n\":%d,"
+		"\"min\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,"
+		"\"max\":%.1f,\"mean\":%.1f}\n", benchname, name, n, samples[0],
+		samples[n / 2], samples[(n * 9) / 10], samples[(n * 99) / 100],
+		samples[(n * 999) / 1000], samples[n - 1], sum / n);
+}
+
+/* metric - Record a single figure, such as a rate, in the results file */
+void metric(char *name, double value, char *unit)
+{
+    if (results != NULL)
+	fprintf(results, "{\"bench\":\"%s\",\"name\":\"%s\",\"unit\":\"%s\",\"value\":%.6g}\n",
+		benchname, name, unit, value);
+}
+
+/*
+ * bench_prompt - Measure child exit to next prompt. The command exits
+ * right after exec, so the round trip is dominated by how quickly
+ * waitfg notices the exit and returns to the read loop.
+ */
+void bench_prompt(void)
+{
+    struct shproc sh;
+    double *samples = malloc(iters * sizeof(double));
+    double t0;
+    int i;
+
+    shell_start(&sh, NULL);
+    shell_expect(&sh, "tsh> ");
+    for (i = 0; i < iters; i++) {
+	t0 = now_us();
+	shell_send(&sh, cmd);
+	shell_expect(&sh, "tsh> ");
+	samples[i] = now_us() - t0;
+    }
+    shell_stop(&sh);
+    report("prompt", samples, iters);
+    free(samples);
+}
+
+/*
+ * bench_jobtable - Time each job list operation at several list sizes.
+ * PIDs are spread out and deletes run in shuffled order so the hash
+ * buckets and the maxjid walk-back both get exercised.
+ */
+void bench_jobtable(void)
+{
+    static int sizes[] = {10, 1000, 100000};
+    double t0, tadd, tpid, tjid, tdel;
+    pid_t *pids;
+    int s, i, j, n, r, rounds;
+    char name[32];
+    pid_t tmp;
+
+    initjobs(jobs);
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+	n = sizes[s];
+	rounds = n < 1000000 ? 1000000 / n : 1;
+	pids = malloc(n * sizeof(pid_t));
+	for (i = 0; i < n; i++)
+	    pids[i] = 100 + i * 37;
+	tadd = tpid = tjid = tdel = 0;
+
+	for (r = 0; r < rounds; r++) {
+	    t0 = now_us();
+	    for (i = 0; i < n; i++)
+		addjob(jobs, pids[i], BG, "./myspin 1 &\n");
+	    tadd += now_us() - t0;
+
+	    t0 = now_us();
+	    for (i = 0; i < n; i++)
+		if (getjobpid(jobs, pids[i]) == NULL)
+		    app_error("getjobpid lost a job");
+	    tpid += now_us() - t0;
+
+	    t0 = now_us();
+	    for (i = 1; i <= n; i++)
+		if (getjobjid(jobs, i) == NULL)
+		    app_error("getjobjid lost a job");
+	    tjid += now_us() - t0;
+
+	    for (i = n - 1; i > 0; i--) {   /* shuffle the delete order */
+		j = rand() % (i + 1);
+		tmp = pids[i]; pids[i] = pids[j]; pids[j] = tmp;
+	    }
+	    t0 = now_us();
+	    for (i = 0; i < n; i++)
+		deletejob(jobs, pids[i]);
+	    tdel += now_us() - t0;
+	    if (maxjid(jobs) != 0)
+		app_error("deletejob left jobs behind");
+	}
+	tadd *= 1e3 / ((double)n * rounds);
+	tpid *= 1e3 / ((double)n * rounds);
+	tjid *= 1e3 / ((double)n * rounds);
+	tdel *= 1e3 / ((double)n * rounds);
+	printf("jobtable   n=%-6d add=%.1f getjobpid=%.1f getjobjid=%.1f "
+	       "delete=%.1f ns/op\n", n, tadd, tpid, tjid, tdel);
+	snprintf(name, sizeof(name), "addjob-%d", n);
+	metric(name, tadd, "ns/op");
+	snprintf(name, sizeof(name), "getjobpid-%d", n);
+	metric(name, tpid, "ns/op");
+	snprintf(name, sizeof(name), "getjobjid-%d", n);
+	metric(name, tjid, "ns/op");
+	snprintf(name, sizeof(name), "deletejob-%d", n);
+	metric(name, tdel, "ns/op");
+	free(pids);
+    }
+}
+
+/*
+ * bench_joblist - Fill the job list and measure what it costs in heap
+ * (job structs, command lines and both indexes, over all of malloc's
+ * in-use bytes) and how long listjobs takes, with output to /dev/null
+ */
+void bench_joblist(void)
+{
+    static int sizes[] = {1000, 100000};
+    size_t base;
+    double t0, t;
+    int s, i, r, n, rounds, saved;
+
+    initjobs(jobs);
+    base = mallinfo2().uordblks;
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+	n = sizes[s];
+	for (i = 0; i < n; i++)
+	    addjob(jobs, 100 + i * 37, BG, "./myspin 1 &\n");
+
+	rounds = 1000000 / n;
+	freopen("/dev/null", "w", stdout);
+	t0 = now_us();
+	for (r = 0; r < rounds; r++)
+	    listjobs(jobs, 0);
+	fflush(stdout);
+	t = (now_us() - t0) * 1e3 / ((double)n * rounds);
+	dup2(saved, STDOUT_FILENO);
+
+	printf("joblist    n=%-6d %.0f bytes/job jobs=%.1f ns/job\n", n,
+	       (double)(mallinfo2().uordblks - base) / n, t);
+	fflush(stdout);
+	for (i = 0; i < n; i++)
+	    deletejob(jobs, 100 + i * 37);
+    }
+    close(saved);
+}
+
+/* randword - Append a random word of 1 to 16 letters to buf */
+char *randword(char *buf)
+{
+    int n = 1 + rand() % 16;
+
+    while (n-- > 0)
+	*buf++ = "abcdefghijklmnopqrstuvwxyz./-_0123456789"[rand() % 40];
+    return buf;
+}
+
+/*
+ * mkcorpus - Generate nlines command lines of up to len bytes and
+ * maxwords words. Plain ones are all plain words. Quoted ones have one
+ * word in ten single-quoted, one double-quoted with an escaped quote
+ * inside, one with a backslash-escaped space, and now and then a pipe.
+ */
+char **mkcorpus(int nlines, int len, int maxwords, int quoted, long *bytes, long *nwords)
+{
+    char **lines = malloc(nlines * sizeof(char *)), *p, *end;
+    int i, words, pipes, kind;
+
+    srand(1);
+    *bytes = *nwords = 0;
+    for (i = 0; i < nlines; i++) {
+	p = lines[i] = malloc(len);
+	end = p + len - 40;
+	for (words = pipes = 0; words < maxwords && p < end; words++) {
+	    if (words > 0)
+		*p++ = ' ';
+	    kind = quoted ? rand() % 40 : 40;
+	    if (kind < 4) {
+		*p++ = '\'';
+		p = randword(p);
+		*p++ = ' ';
+		p = randword(p);
+		*p++ = '\'';
+	    }
+	    else if (kind < 8) {
+		*p++ = '"';
+		p = randword(p);
+		*p++ = '\\';
+		*p++ = '"';
+		p = randword(p);
+		*p++ = '"';
+	    }
+	    else if (kind < 12) {
+		p = randword(p);
+		*p++ = '\\';
+		*p++ = ' ';
+		p = randword(p);
+	    }
+	    else if (kind == 12 && words > 0 && ++pipes < MAXSTAGES) {
+		p = randword(p);
+		p = stpcpy(p, " | ");
+		p = randword(p);
+	    }
+	    else
+		p = randword(p);
+	}
+	p = stpcpy(p, "\n");
+	*bytes += p - lines[i];
+	*nwords += words;
+    }
+    return lines;
+}
+
+/*
+ * bench_tokenize - Parse each corpus of command lines repeatedly: lines
+ * of up to 1000 bytes, plain and quoted, then quoted lines of 256K
+ * that grow the buffers once and reuse them after that.
+ */
+void bench_tokenize(void)
+{
+    static const char *names[] = {"plain", "quoted", "huge"};
+    int nlines, rounds = 20, i, r, kind;
+    struct cmd_t cmd = {NULL};
+    char **lines;
+    long bytes, nwords;
+    double t0, t;
+    char name[32];
+
+    for (kind = 0; kind < 3; kind++) {
+	nlines = kind < 2 ? 10000 : 40;
+	if (kind < 2)
+	    lines = mkcorpus(nlines, MAXLINE, MAXARGS - 8, kind, &bytes, &nwords);
+	else
+	    lines = mkcorpus(nlines, 1 << 18, INT_MAX, 1, &bytes, &nwords);
+	t0 = now_us();
+	for (r = 0; r < rounds; r++)
+	    for (i = 0; i < nlines; i++)
+		if (parseline(lines[i], &cmd) != 0 || cmd.argv[0] == NULL)
+		    app_error("bad line in the corpus");
+	t = now_us() - t0;
+	printf("tokenize   %-6s bytes/line=%ld words/line=%ld %.0f MB/s "
+	       "%.0f ns/line %.1f ns/word\n", names[kind],
+	       bytes / nlines, nwords / nlines, bytes * rounds / t,
+	       t * 1e3 / nlines / rounds, t * 1e3 / nwords / rounds);
+	snprintf(name, sizeof(name), "parseline-%s", names[kind]);
+	metric(name, t * 1e3 / nwords / rounds, "ns/word");
+	for (i = 0; i < nlines; i++)
+	    free(lines[i]);
+	free(lines);
+    }
+    free(cmd.buf);
+    free(cmd.argv);
+}
+
+/* rss_mb - Resident set size of this process in MB */
+long rss_mb(void)
+{
+    long pages = 0, resident = 0;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/statm", "r")) != NULL) {
+	if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+	    resident = 0;
+	fclose(fp);
+    }
+    return resident * sysconf(_SC_PAGESIZE) >> 20;
+}
+
+/*
+ * bench_spawn - Launch /bin/true repeatedly with each backend while the
+ * process is padded out to a series of resident set sizes. fork has to
+ * copy the page tables for the whole RSS; posix_spawn should not care.
+ */
+void bench_spawn(void)
+{
+    char *argv[] = {"/bin/true", NULL};
+    struct stage_t stage = {argv, 0};
+    char *sizes = strdup(rss_sizes), *tok, name[32], c;
+    double *samples = malloc(iters * sizeof(double)), rate[2], t0, t1;
+    sigset_t mask;
+    long target, grow;
+    char *pad;
+    pid_t pid;
+    int mode, i, fds[2];
+
+    sigprocmask(SIG_SETMASK, NULL, &mask);
+    for (tok = strtok(sizes, ","); tok != NULL; tok = strtok(NULL, ",")) {
+	target = atol(tok);
+	if ((grow = (target - rss_mb()) << 20) > 0) {   /* touch new ballast */
+	    if ((pad = malloc(grow)) == NULL)
+		unix_error("malloc error");
+	    memset(pad, 1, grow);
+	}
+	for (mode = 0; mode < 2; mode++) {
+	    usefork = !mode;
+	    t0 = now_us();
+	    for (i = 0; i < iters; i++) {
+		/* The child's copy of the write end closes when it execs */
+		if (pipe2(fds, O_CLOEXEC) < 0)
+		    unix_error("pipe error");
+		t1 = now_us();
+		if ((pid = launch(&stage, &mask, 0, STDIN_FILENO, STDOUT_FILENO, NULL)) == 0)
+		    app_error("launch failed");
+		close(fds[1]);
+		if (read(fds[0], &c, 1) != 0)
+		    app_error("exec pipe error");
+		samples[i] = now_us() - t1;
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+	    }
+	    rate[mode] = iters / ((now_us() - t0) / 1e6);
+	    snprintf(name, sizeof(name), "%s-%ldMB", mode ? "posix_spawn" : "fork", rss_mb());
+	    report(name, samples, iters);
+	    metric(name, rate[mode], "1/s");
+	}
+	printf("spawn      rss=%ldMB fork=%.0f posix_spawn=%.0f cmds/s\n",
+	       rss_mb(), rate[0], rate[1]);
+    }
+    free(sizes);
+    free(samples);
+}
+
+/* parse_size - Convert a head -c style size such as 10G to bytes */
+double parse_size(char *s)
+{
+    char *end;
+    double n = strtod(s, &end);
+
+    switch (*end) {
+    case 'G': n *= 1024;        /* fall through */
+    case 'M': n *= 1024;        /* fall through */
+    case 'K': n *= 1024;
+    }
+    return n;
+}
+
+/*
+ * bench_pipeline - Push a stream through a 3-stage pipeline started by
+ * the shell, and through the same pipeline under /bin/sh for scale.
+ */
+void bench_pipeline(void)
+{
+    char line[MAXBUF];
+    struct shproc sh;
+    double t0, tsh, tsys;
+
+    snprintf(line, MAXBUF, "head -c %s /dev/zero | cat | wc -c > /dev/null",
+	     stream_size);
+    t0 = now_us();
+    if (system(line) != 0)
+	app_error("pipeline failed under /bin/sh");
+    tsys = now_us() - t0;
+
+    snprintf(line, MAXBUF, "head -c %s /dev/zero | cat | wc -c\n", stream_size);
+    shell_start(&sh, NULL);
+    shell_expect(&sh, "tsh> ");
+    t0 = now_us();
+    shell_send(&sh, line);
+    shell_expect(&sh, "tsh> ");
+    tsh = now_us() - t0;
+    shell_stop(&sh);
+
+    printf("pipeline   size=%s tsh=%.2f GB/s sh=%.2f GB/s\n", stream_size,
+	   parse_size(stream_size) / tsh / 1e3, parse_size(stream_size) / tsys / 1e3);
+}
+
+/*
+ * bench_parallel - Fan the latency command out over iters arguments
+ * with the parallel builtin at several widths. The arguments come from
+ * a file so the command line stays short; the same file is fed to
+ * xargs -P as the yardstick.
+ */
+void bench_parallel(void)
+{
+    char file[] = "/tmp/tshbench.XXXXXX", line[2 * MAXBUF], *c;
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int widths[3] = {1, ncpu, 4 * ncpu};
+    struct shproc sh;
+    double t0, tsh, txargs;
+    FILE *fp;
+    int fd, w, i;
+
+    if ((fd = mkstemp(file)) < 0 || (fp = fdopen(fd, "w")) == NULL)
+	unix_error("mkstemp error");
+    for (i = 0; i < iters; i++)
+	fprintf(fp, "%d\n", i);
+    fclose(fp);
+    if ((c = strchr(cmd, '\n')) != NULL)
+	*c = '\0';
+
+    shell_start(&sh, NULL);
+    shell_expect(&sh, "tsh> ");
+    for (w = 0; w < 3; w++) {
+	snprintf(line, sizeof(line), "parallel -j %d %s {} :::: %s\n", widths[w], cmd, file);
+	t0 = now_us();
+	shell_send(&sh, line);
+	shell_expect(&sh, "killed\ntsh> ");
+	tsh = now_us() - t0;
+
+	snprintf(line, sizeof(line), "xargs -P %d -n 1 %s < %s", widths[w], cmd, file);
+	t0 = now_us();
+	if (system(line) != 0)
+	    app_error("xargs failed");
+	txargs = now_us() - t0;
+
+	printf("parallel   j=%-4d tasks=%d tsh=%.0f xargs=%.0f tasks/s\n",
+	       widths[w], iters, iters / (tsh / 1e6), iters / (txargs / 1e6));
+    }
+    shell_stop(&sh);
+    unlink(file);
+}
+
+/*
+ * run_shell - Run the shell to completion with stdin from infile and
+ * stdout discarded, and return the elapsed microseconds
+ */
+double run_shell(char *arg, char *infile)
+{
+    double t0 = now_us();
+    pid_t pid;
+    int fd;
+
+    if ((pid = fork()) == 0) {
+	if ((fd = open(infile, O_RDONLY)) < 0 || dup2(fd, 0) < 0)
+	    unix_error(infile);
+	if ((fd = open("/dev/null", O_WRONLY)) < 0 || dup2(fd, 1) < 0)
+	    unix_error("/dev/null");
+	execl(shell, shell, arg, (char *)NULL);
+	perror(shell);
+	exit(1);
+    }
+    waitpid(pid, NULL, 0);
+    return now_us() - t0;
+}
+
+/*
+ * bench_batch - Compare a script run in batch mode against the same
+ * lines fed through the interactive read loop on a pipe
+ */
+void bench_batch(void)
+{
+    static char *builtins[] = {"jobs", "hash true", "# comment", "", "bg",
+			       "jobs", "hash", "fg %9", "jobs", "hash -r"};
+    char file[] = "/tmp/tshbench.XXXXXX";
+    double tfile, tstdin;
+    int lines = 100000, every, fd, i;
+    FILE *fp;
+
+    /* First builtins only, then with every tenth line a command */
+    for (every = 0; every <= 10; every += 10) {
+	if ((fd = mkstemp(file)) < 0 || (fp = fdopen(fd, "w")) == NULL)
+	    unix_error("mkstemp error");
+	for (i = 0; i < lines; i++)
+	    if (every && i % every == every - 1)
+		fputs(cmd, fp);
+	    else
+		fprintf(fp, "%s\n", builtins[i % 10]);
+	fclose(fp);
+
+	tfile = run_shell(file, "/dev/null");
+	tstdin = run_shell("-p", file);
+	printf("batch      lines=%d cmds=%d script=%.0f stdin=%.0f lines/s\n",
+	       lines, every ? lines / every : 0, lines / (tfile / 1e6),
+	       lines / (tstdin / 1e6));
+	unlink(file);
+	strcpy(file, "/tmp/tshbench.XXXXXX");
+    }
+}
+
+/*
+ * bench_reap - Kill iters background children at once. The shell has to
+ * reap the whole burst and print one "terminated by signal" line per
+ * job; count the lines per JID to catch lost and doubled reports, and
+ * check "jobs" comes back empty.
+ */
+void bench_reap(void)
+{
+    pid_t *pids = malloc(iters * sizeof(pid_t)), pid;
+    char *seen = calloc(iters + 1, 1), line[MAXBUF];
+    int i, jid, sig, n = 0, dup = 0, left = 0;
+    struct shproc sh;
+    double t0, t;
+
+    shell_start(&sh, "-p");
+    for (i = 0; i < iters; i++) {
+	shell_send(&sh, "./myspin 1000 &\n");
+	if (shell_readline(&sh, line, 10000) < 0 ||
+	    sscanf(line, "[%d] (%d)", &jid, &pids[i]) != 2)
+	    app_error("background job did not start");
+    }
+
+    t0 = now_us();
+    for (i = 0; i < iters; i++)
+	kill(pids[i], SIGTERM);
+    while (n < iters && shell_readline(&sh, line, 10000) >= 0) {
+	if (sscanf(line, "Job [%d] (%d) terminated by signal %d", &jid, &pid, &sig) != 3)
+	    continue;
+	if (jid < 1 || jid > iters || seen[jid]++)
+	    dup++;
+	else
+	    n++;
+    }
+    t = now_us() - t0;
+
+    shell_send(&sh, "jobs\n/bin/echo end\n");
+    while (shell_readline(&sh, line, 10000) >= 0 && strcmp(line, "end\n") != 0)
+	left++;
+    shell_stop(&sh);
+    printf("reap       children=%d reported=%d dup=%d lost=%d left=%d %.0f reaps/s\n",
+	   iters, n, dup, iters - n, left, n / (t / 1e6));
+    metric("reaps", n / (t / 1e6), "1/s");
+    metric("lost", iters - n + dup, "jobs");
+    free(pids);
+    free(seen);
+}
+
+/*
+ * bench_bgdone - Keep LIVEJOBS background children running and kill
+ * iters more, one at a time, timing each until its report comes out
+ */
+#define LIVEJOBS 5000
+void bench_bgdone(void)
+{
+    int n = LIVEJOBS + iters, i, jid;
+    pid_t *pids = malloc(n * sizeof(pid_t)), pid;
+    double *samples = malloc(iters * sizeof(double)), t0;
+    char line[MAXBUF], want[64];
+    struct shproc sh;
+
+    shell_start(&sh, "-p");
+    for (i = 0; i < n; i++) {
+	shell_send(&sh, "./myspin 1000 &\n");
+	if (shell_readline(&sh, line, 10000) < 0 ||
+	    sscanf(line, "[%d] (%d)", &jid, &pids[i]) != 2)
+	    app_error("background job did not start");
+    }
+
+    for (i = 0; i < iters; i++) {
+	pid = pids[LIVEJOBS + i];
+	snprintf(want, sizeof(want), "(%d) terminated by signal %d", pid, SIGTERM);
+	t0 = now_us();
+	kill(pid, SIGTERM);
+	do {
+	    if (shell_readline(&sh, line, 10000) < 0)
+		app_error("completion was not reported");
+	} while (strstr(line, want) == NULL);
+	samples[i] = now_us() - t0;
+    }
+
+    for (i = 0; i < LIVEJOBS; i++)
+	kill(pids[i], SIGKILL);
+    shell_stop(&sh);
+    report("bgdone", samples, iters);
+    free(pids);
+    free(samples);
+}
+
+/*
+ * run_script - Run the shell on a script with stdout going to outfile,
+ * and its event trace to tracefile unless that is NULL, and return the
+ * elapsed microseconds
+ */
+double run_script(char *script, char *outfile, char *tracefile)
+{
+    double t0 = now_us();
+    pid_t pid;
+    int fd;
+
+    if ((pid = fork()) == 0) {
+	if ((fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 || dup2(fd, 1) < 0)
+	    unix_error(outfile);
+	if (tracefile != NULL)
+	    execl(shell, shell, "-t", tracefile, script, (char *)NULL);
+	else
+	    execl(shell, shell, script, (char *)NULL);
+	perror(shell);
+	exit(1);
+    }
+    waitpid(pid, NULL, 0);
+    return now_us() - t0;
+}
+
+/* count_spawns - Number of children started in a trace the shell wrote */
+long count_spawns(char *tracefile)
+{
+    char line[MAXBUF];
+    long n = 0;
+    FILE *fp;
+
+    if ((fp = fopen(tracefile, "r")) == NULL)
+	unix_error(tracefile);
+    while (fgets(line, MAXBUF, fp) != NULL)
+	n += strstr(line, "\"name\":\"spawn\"") != NULL || strstr(line, "\"name\":\"fork\"") != NULL;
+    fclose(fp);
+    return n;
+}
+
+/*
+ * bench_builtins - First make sure every builtin is found in its own
+ * slot of the perfect-hash table. Then take the lines of trace01-16
+ * that don't start or signal jobs, i.e. their /bin/echo lines and
+ * "jobs", and run them as a script iters times over: as they are, and
+ * with /bin/echo turned into the echo builtin. Both runs must print the
+ * same thing. Forks are counted from the shell's own trace of one pass.
+ */
+void bench_builtins(void)
+{
+    char script[] = "/tmp/tshbench.XXXXXX", *out[2] = {"/tmp/tshbench.out0", "/tmp/tshbench.out1"};
+    char *trace = "/tmp/tshbench.json", name[32], line[MAXBUF], *lines[1024];
+    double t[2];
+    long forks[2];
+    int nlines = 0, builtin, fd, i, r;
+    FILE *fp;
+
+    for (i = 0; i < 64; i++)
+	if (builtins[i].name != NULL && findbuiltin(builtins[i].name) != &builtins[i])
+	    app_error("builtin table: a name is in the wrong slot");
+
+    for (i = 1; i <= 16; i++) {
+	snprintf(name, sizeof(name), "trace%02d.txt", i);
+	if ((fp = fopen(name, "r")) == NULL)
+	    unix_error(name);
+	while (fgets(line, MAXBUF, fp) != NULL && nlines < 1024)
+	    if (!strncmp(line, "/bin/echo ", 10) || !strcmp(line, "jobs\n"))
+		lines[nlines++] = strdup(line);
+	fclose(fp);
+    }
+
+    for (builtin = 0; builtin <= 1; builtin++) {
+	for (r = 0; r <= 1; r++) {
+	    if ((fd = mkstemp(script)) < 0 || (fp = fdopen(fd, "w")) == NULL)
+		unix_error("mkstemp error");
+	    for (i = 0; i < nlines * (r ? iters : 1); i++)
+		fputs(builtin && !strncmp(lines[i % nlines], "/bin/", 5) ?
+		      lines[i % nlines] + 5 : lines[i % nlines], fp);
+	    fclose(fp);
+	    if (r == 0) {       /* one traced pass, to count the forks */
+		run_script(script, out[builtin], trace);
+		forks[builtin] = count_spawns(trace) * iters;
+	    }
+	    else
+		t[builtin] = run_script(script, out[builtin], NULL);
+	    unlink(script);
+	    strcpy(script, "/tmp/tshbench.XXXXXX");
+	}
+    }
+    snprintf(line, MAXBUF, "cmp -s %s %s", out[0], out[1]);
+    if (system(line) != 0)
+	app_error("echo builtin prints something other than /bin/echo");
+
+    printf("builtins   lines=%d forks: /bin/echo=%ld builtin=%ld avoided=%ld\n",
+	   nlines * iters, forks[0], forks[1], forks[0] - forks[1]);
+    printf("builtins   wall: /bin/echo=%.0f ms builtin=%.0f ms saved=%.0f ms (%.1f us/line)\n",
+	   t[0] / 1e3, t[1] / 1e3, (t[0] - t[1]) / 1e3, (t[0] - t[1]) / (nlines * iters));
+    unlink(out[0]);
+    unlink(out[1]);
+    unlink(trace);
+    for (i = 0; i < nlines; i++)
+	free(lines[i]);
+}
+
+/*
+ * server_client - Connect to the job server at path and send it line
+ * iters times, timing each until its reply frame is all in, which must
+ * carry status 0
+ */
+void server_client(char *path, char *line, double *samples)
+{
+    struct sockaddr_un addr = {AF_UNIX};
+    char buf[MAXBUF], *nl;
+    size_t len = strlen(line), have = 0, need;
+    int fd, i, status;
+    ssize_t n;
+    double t0;
+
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	unix_error(path);
+    for (i = 0; i < iters; i++) {
+	t0 = now_us();
+	if (write(fd, line, len) != (ssize_t)len)
+	    unix_error("write error");
+	while ((nl = memchr(buf, '\n', have)) == NULL ||
+	       have < (need = nl + 1 - buf + strtoul(buf, NULL, 10))) {
+	    if ((n = read(fd, buf + have, MAXBUF - have)) <= 0)
+		app_error("server hung up");
+	    have += n;
+	}
+	if (sscanf(buf, "%*u %d", &status) != 1 || status != 0)
+	    app_error("server: command failed");
+	memmove(buf, buf + need, have - need);
+	have -= need;
+	samples[i] = now_us() - t0;
+    }
+    close(fd);
+}
+
+/*
+ * bench_server - Run NCLIENTS clients against one job server, each in
+ * its own process, first submitting the true builtin and then cmd as
+ * a background job. The samples come back through shared memory.
+ */
+#define NCLIENTS 64
+void bench_server(void)
+{
+    char *path = "/tmp/tshbench.sock", *lines[2] = {"true\n", NULL}, *names[2] = {"server-builtin", "server-job"};
+    char job[MAXBUF + 2];
+    int n = NCLIENTS * iters, fd, kind, c, failed = 0, stat;
+    double *samples = mmap(NULL, n * sizeof(double), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0), t0, t;
+    struct sockaddr_un addr = {AF_UNIX};
+    pid_t server, pids[NCLIENTS];
+
+    if (samples == MAP_FAILED)
+	unix_error("mmap error");
+    snprintf(job, sizeof(job), "%.*s &\n", (int)strcspn(cmd, "\n"), cmd);
+    lines[1] = job;
+
+    fflush(stdout);
+    if ((server = fork()) == 0) {
+	if ((fd = open("/dev/null", O_WRONLY)) < 0 || dup2(fd, 1) < 0)
+	    unix_error("/dev/null");
+	execl(shell, shell, "-S", path, (char *)NULL);
+	perror(shell);
+	exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    for (c = 0; c < 1000; c++) {        /* wait until it is listening */
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	    unix_error("socket error");
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+	    break;
+	close(fd);
+	usleep(10000);
+    }
+    if (c == 1000)
+	app_error("server did not start");
+    close(fd);
+
+    for (kind = 0; kind <= 1; kind++) {
+	fflush(stdout);
+	t0 = now_us();
+	for (c = 0; c < NCLIENTS; c++)
+	    if ((pids[c] = fork()) == 0) {
+		server_client(path, lines[kind], samples + c * iters);
+		_exit(0);
+	    }
+	for (c = 0; c < NCLIENTS; c++)
+	    if (waitpid(pids[c], &stat, 0) < 0 || stat != 0)
+		failed++;
+	t = now_us() - t0;
+	if (failed)
+	    app_error("a client failed");
+	printf("server     clients=%d submissions=%d %.0f submissions/s (%s)\n",
+	       NCLIENTS, n, n / (t / 1e6), kind ? "jobs" : "builtin");
+	report(names[kind], samples, n);
+    }
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink(path);
+    munmap(samples, n * sizeof(double));
+}
+
+/*
+ * attrs_run - Time the prompt round trip of cmd while n background
+ * burners, started with the on prefix unless it is NULL, keep the
+ * CPUs busy
+ */
+void attrs_run(char *name, char *prefix, int n, double *samples)
+{
+    struct shproc sh;
+    char line[MAXBUF];
+    double t0;
+    int i;
+
+    shell_start(&sh, NULL);
+    shell_expect(&sh, "tsh> ");
+    for (i = 0; i < n; i++) {
+	snprintf(line, MAXBUF, "%s%s/usr/bin/yes > /dev/null &\n",
+		 prefix ? prefix : "", prefix ? " " : "");
+	shell_send(&sh, line);
+	shell_expect(&sh, "tsh> ");
+    }
+    usleep(100000);             /* let them get going */
+    for (i = 0; i < iters; i++) {
+	t0 = now_us();
+	shell_send(&sh, cmd);
+	shell_expect(&sh, "tsh> ");
+	samples[i] = now_us() - t0;
+    }
+    for (i = 1; i <= n; i++) {
+	snprintf(line, MAXBUF, "kill %%%d\n", i);
+	shell_send(&sh, line);
+	shell_expect(&sh, "tsh> ");
+    }
+    shell_send(&sh, "wait\n");
+    shell_expect(&sh, "tsh> ");
+    shell_stop(&sh);
+    report(name, samples, iters);
+}
+
+/*
+ * bench_attrs - Show what launch attributes on the background load do
+ * for the foreground: idle, loaded, and loaded with the load niced or
+ * kept off a CPU
+ */
+void bench_attrs(void)
+{
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN), n = 2 * ncpus;
+    double *samples = malloc(iters * sizeof(double));
+    char prefix[64];
+
+    printf("attrs      cpus=%d burners=%d\n", ncpus, n);
+    attrs_run("idle", NULL, 0, samples);
+    attrs_run("busy", NULL, n, samples);
+    attrs_run("busy-nice", "on nice=19", n, samples);
+    if (ncpus > 1) {
+	snprintf(prefix, sizeof(prefix), "on cpus=1-%d", ncpus - 1);
+	attrs_run("busy-cpus", prefix, n, samples);
+    }
+    free(samples);
+}
+
+/*
+ * bench_deadlines - In-process, give n jobs deadlines an hour or two
+ * out, in random order, and delete the jobs in another, which takes
+ * each out of the heap. Then end to end, start iters jobs that would
+ * outlive their "timeout 1" and time from each one's deadline to its
+ * report; every job must be reported once.
+ */
+void bench_deadlines(void)
+{
+    static int sizes[] = {1000, 10000, 100000};
+    double t0, tset, tdel, now, *started = malloc(iters * sizeof(double));
+    double *samples = malloc(iters * sizeof(double));
+    pid_t *pids = malloc(100000 * sizeof(pid_t)), pid, tmp;
+    int s, i, j, n, jid, sig, started_n = 0, reported = 0;
+    char line[MAXBUF];
+    struct shproc sh;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	unix_error("epoll_create error");
+    initjobs(jobs);
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+	n = sizes[s];
+	for (i = 0; i < n; i++)
+	    pids[i] = 100 + i * 37;
+	for (i = 0; i < n; i++)
+	    addjob(jobs, pids[i], BG, "timeout 1h ./myspin 1 &\n");
+	t0 = now_us();
+	for (i = 0; i < n; i++)
+	    setdeadline(getjobpid(jobs, pids[i]), 3600e9 + rand() % 3600 * 1e9, TIMEOUTGRACE);
+	tset = (now_us() - t0) * 1e3 / n;
+	for (i = n - 1; i > 0; i--) {   /* shuffle the delete order */
+	    j = rand() % (i + 1);
+	    tmp = pids[i]; pids[i] = pids[j]; pids[j] = tmp;
+	}
+	t0 = now_us();
+	for (i = 0; i < n; i++)
+	    deletejob(jobs, pids[i]);
+	tdel = (now_us() - t0) * 1e3 / n;
+	if (ndeadlines != 0)
+	    app_error("deletejob left deadlines behind");
+	printf("deadlines  n=%-6d setdeadline=%.1f deletejob=%.1f ns/op\n", n, tset, tdel);
+    }
+
+    shell_start(&sh, "-p");
+    while (reported < iters) {
+	if (started_n < iters)
+	    shell_send(&sh, "timeout 1 ./myspin 100 &\n");
+	do {
+	    if (shell_readline(&sh, line, 10000) < 0)
+		app_error("jobs were not all reported");
+	    now = now_us();
+	    if (sscanf(line, "[%d] (%d)", &jid, &pid) == 2)
+		pids[started_n] = pid, started[started_n++] = now;
+	    else if (sscanf(line, "Job [%d] (%d) killed by timeout (signal %d)", &jid, &pid, &sig) == 3) {
+		for (i = 0; i < started_n && pids[i] != pid; i++)
+		    ;
+		if (i == started_n)
+		    app_error("a job was reported twice, or never started");
+		samples[reported++] = now - started[i] - 1e6;
+		pids[i] = 0;
+	    }
+	} while (started_n < iters && line[0] != '[');
+    }
+    shell_stop(&sh);
+    report("lateness", samples, iters);
+    free(pids);
+    free(started);
+    free(samples);
+}
+
+/*
+ * signals_run - Start a long ./myspin in the foreground iters times,
+ * send the shell sig once it has had time to start, and time the
+ * shell's report of what the job did, which has to contain want. A
+ * stopped job is killed before the next.
+ */
+void signals_run(char *name, int sig, char *want)
+{
+    double *samples = malloc(iters * sizeof(double)), t0;
+    char line[MAXBUF];
+    struct shproc sh;
+    int i;
+
+    shell_start(&sh, "-p");
+    for (i = 0; i < iters; i++) {
+	shell_send(&sh, "./myspin 100\n");
+	usleep(20000);          /* for it to be running */
+	t0 = now_us();
+	kill(sh.pid, sig);
+	do {
+	    if (shell_readline(&sh, line, 10000) < 0)
+		app_error("the job was not reported");
+	} while (strstr(line, want) == NULL);
+	samples[i] = now_us() - t0;
+	if (sig == SIGTSTP) {
+	    shell_send(&sh, "kill -9 %1\n");
+	    do {
+		if (shell_readline(&sh, line, 10000) < 0)
+		    app_error("the stopped job was not killed");
+	    } while (strstr(line, "terminated by signal 9") == NULL);
+	}
+    }
+    shell_stop(&sh);
+    report(name, samples, iters);
+    free(samples);
+}
+
+/*
+ * bench_signals - Latency of ctrl-c and ctrl-z: from the signal to the
+ * shell to its report, which takes in forwarding it to the job's
+ * process group, the job stopping or dying, and the reaper noticing
+ */
+void bench_signals(void)
+{
+    char want[64];
+
+    snprintf(want, sizeof(want), "terminated by signal %d", SIGINT);
+    signals_run("sigint", SIGINT, want);
+    snprintf(want, sizeof(want), "stopped by signal %d", SIGTSTP);
+    signals_run("sigtstp", SIGTSTP, want);
+}
+
+/*
+ * bench_fanout - Keep FANOUTJOBS myfanout trees running in the
+ * background until iters of them have ended, continuing each one that
+ * stops itself with bg. Every tree has to end exactly once, with its
+ * own summary or a "terminated" report, a tree that finishes must
+ * count all its processes, and the shell must report a stop for a tree
+ * iff it sent itself some (its leaves may stop it together, so the
+ * shell can report fewer).
+ */
+#define FANOUTJOBS 32
+#define FANOUTCMD "./myfanout -w 3 -d 2 -l 200-2000 -s 5 -i 2 &\n"
+#define FANOUTPROCS 13          /* 1 + 3 + 9 */
+void bench_fanout(void)
+{
+    struct {
+	pid_t pid;
+	int started, ended, stops;      /* lines seen, bg echoes included */
+    } slot[2 * FANOUTJOBS] = {{0}};
+    int sent = 0, ended = 0, stops = 0, ints = 0, ok = 0, bad = 0, dup = 0;
+    int i, jid, sig, procs, nstops;
+    char line[MAXBUF], bg[32];
+    struct shproc sh;
+    pid_t pid;
+    double t0, t;
+
+    shell_start(&sh, "-p");
+    t0 = now_us();
+    while (ended < iters) {
+	while (sent < iters && sent - ended < FANOUTJOBS) {
+	    shell_send(&sh, FANOUTCMD);
+	    sent++;
+	}
+	if (shell_readline(&sh, line, 10000) < 0)
+	    break;
+	if (sscanf(line, "[%d] (%d)", &jid, &pid) == 2)
+	    procs = -1;
+	else if (sscanf(line, "Job [%d] (%d) stopped by signal %d", &jid, &pid, &sig) == 3)
+	    procs = -2;
+	else if (sscanf(line, "Job [%d] (%d) terminated by signal %d", &jid, &pid, &sig) == 3)
+	    procs = -3;
+	else if (sscanf(line, "myfanout (%d): procs=%d stops=%d", &pid, &procs, &nstops) != 3)
+	    continue;
+
+	/*
+	 * A tree's summary can beat the shell's line saying it started,
+	 * or the echo of the bg that let it finish
+	 */
+	for (i = 0; i < 2 * FANOUTJOBS && slot[i].pid != pid; i++)
+	    ;
+	if (i == 2 * FANOUTJOBS) {
+	    for (i = 0; i < 2 * FANOUTJOBS && slot[i].pid != 0; i++)
+		;
+	    if (i == 2 * FANOUTJOBS)
+		app_error("more trees in flight than started");
+	    slot[i].pid = pid;
+	}
+	if (procs == -1) {
+	    slot[i].started++;
+	} else if (procs == -2) {
+	    slot[i].stops++;
+	    stops++;
+	    snprintf(bg, sizeof(bg), "bg %%%d\n", jid);
+	    shell_send(&sh, bg);
+	} else {
+	    if (slot[i].ended++)
+		dup++;
+	    if (procs == -3)
+		ints++;
+	    else if (procs == FANOUTPROCS && slot[i].stops <= nstops &&
+		     (slot[i].stops > 0) == (nstops > 0))
+		ok++;
+	    else
+		bad++;
+	    ended++;
+	}
+	if (slot[i].ended && slot[i].started == 1 + slot[i].stops)
+	    memset(&slot[i], 0, sizeof(slot[i]));
+    }
+    t = now_us() - t0;
+    shell_stop(&sh);
+
+    printf("fanout     jobs=%d ended=%d finished=%d interrupted=%d stops=%d bad=%d dup=%d lost=%d\n",
+	   iters, ended, ok + bad, ints, stops, bad, dup, iters - ended);
+    printf("fanout     %.0f jobs/s %.0f procs/s %.0f shell events/s\n",
+	   ended / (t / 1e6), ended * FANOUTPROCS / (t / 1e6),
+	   (sent + 2 * stops + ended) / (t / 1e6));
+    metric("jobs", ended / (t / 1e6), "1/s");
+    metric("events", (sent + 2 * stops + ended) / (t / 1e6), "1/s");
+    metric("bad", iters - ended + bad + dup, "jobs");
+}
+
+/*
+ * bench_history - Write a history file of iters entries, of a few
+ * kinds of command with many repeats, and time indexing it and
+ * histfind in-process; then, end to end, shell startup with it and
+ * with an empty one, the first !prefix (which maps and indexes the
+ * file), later ones, and a history -s that has to scan it all.
+ */
+#define HISTSTARTS 20
+void bench_history(void)
+{
+    char file[64], line[MAXBUF], *empty = "/dev/null";
+    double *samples = malloc((iters > 200 ? iters : 200) * sizeof(double)), t0, t;
+    struct shproc sh;
+    FILE *fp;
+    int i, j, k;
+
+    snprintf(file, sizeof(file), "/tmp/tshbench-history.%d", getpid());
+    if ((fp = fopen(file, "w")) == NULL)
+	unix_error(file);
+    for (i = 0; i < iters; i++) {
+	switch (i % 4) {
+	case 0:
+	    fprintf(fp, "./myspin %d &\n", rand() % 100);
+	    break;
+	case 1:
+	    fprintf(fp, "/bin/echo build %d of %d\n", rand() % 10000, i);
+	    break;
+	case 2:
+	    fprintf(fp, "timeout 30 ./tool --seed=%d data/part-%05d.bin\n", rand(), i % 50000);
+	    break;
+	default:
+	    fprintf(fp, "true %d\n", i);
+	}
+    }
+    fclose(fp);
+
+    /* In-process: index the file, then look up prefixes of entries */
+    if ((histfd = open(file, O_RDONLY)) < 0)
+	unix_error(file);
+    t0 = now_us();
+    histsync(SIZE_MAX);
+    t = now_us() - t0;
+    printf("history    entries=%zu index=%.1f ms (%.0f entries/s) nodes=%zu bytes/entry=%.1f\n",
+	   nhist, t / 1e3, nhist / (t / 1e6), nhistnodes,
+	   (double)(histnodecap * sizeof(*histnodes) + histcap * sizeof(*histoff)) / nhist);
+    metric("index", nhist / (t / 1e6), "1/s");
+    t0 = now_us();
+    for (i = 0; i < 1000000; i++) {
+	j = rand() % nhist + 1;
+	k = histlen(j) / 2 + 1;
+	if (histfind(histmap + histoff[j - 1], k) < (size_t)j)
+	    app_error("histfind missed a newer entry");
+    }
+    t = (now_us() - t0) * 1e3 / 1000000;
+    printf("history    histfind=%.1f ns/op\n", t);
+    metric("histfind", t, "ns");
+    close(histfd);
+
+    /* End to end: startup with no history and with this one */
+    for (k = 0; k < 2; k++) {
+	setenv("TSH_HISTORY", k == 0 ? empty : file, 1);
+	for (i = 0; i < HISTSTARTS; i++) {
+	    t0 = now_us();
+	    shell_start(&sh, NULL);
+	    shell_expect(&sh, "tsh> ");
+	    samples[i] = now_us() - t0;
+	    shell_stop(&sh);
+	}
+	report(k == 0 ? "start-0" : "start-big", samples, HISTSTARTS);
+    }
+
+    /*
+     * The shell indexes the file while it waits at the prompt: a lookup
+     * made at once has to finish that, one made a little later doesn't
+     */
+    for (k = 0; k < 2; k++) {
+	shell_start(&sh, NULL);
+	shell_expect(&sh, "tsh> ");
+	if (k == 1)
+	    sleep(2);
+	t0 = now_us();
+	shell_send(&sh, "!true\n");
+	shell_expect(&sh, "tsh> ");
+	t = now_us() - t0;
+	printf("history    first !prefix %s %.1f ms\n", k == 0 ? "at once" : "after 2s", t / 1e3);
+	metric(k == 0 ? "first" : "first-idle", t, "us");
+	if (k == 0)
+	    shell_stop(&sh);
+    }
+    for (i = 0; i < 200; i++) {
+	snprintf(line, sizeof(line), "!true %d\n", rand() % iters);
+	t0 = now_us();
+	shell_send(&sh, line);
+	shell_expect(&sh, "tsh> ");
+	samples[i] = now_us() - t0;
+    }
+    report("!prefix", samples, 200);
+    for (i = 0; i < 20; i++) {
+	t0 = now_us();
+	shell_send(&sh, "history -s no-such-command\n");
+	shell_expect(&sh, "tsh> ");
+	samples[i] = now_us() - t0;
+    }
+    report("search", samples, 20);
+    shell_stop(&sh);
+    unlink(file);
+    free(samples);
+}
+
+/*
+ * bench_glob - Make a directory of iters files and expand patterns
+ * over it with parseline: after the directory changed (so the listing
+ * is read again) and from the cache. bash, which reads the directory
+ * every time, expands the same patterns for reference and has to find
+ * as many matches.
+ */
+#define GLOBFRESH 5
+#define GLOBWARM 20
+#define GLOBBASH 3
+void bench_glob(void)
+{
+    static const char *pats[] = {"*", "*7.bin", "f00012*", "f[0-4]*5?.bin", "*.txt"};
+    char dir[64], path[128], line[MAXBUF], out[64];
+    double samples[GLOBWARM], t0, t;
+    struct cmd_t cmd = {NULL};
+    FILE *fp;
+    int i, k, fd;
+    long n, want;
+
+    snprintf(dir, sizeof(dir), "/tmp/tshbench-glob.%d", getpid());
+    if (mkdir(dir, 0755) < 0)
+	unix_error(dir);
+    t0 = now_us();
+    for (i = 0; i < iters; i++) {
+	snprintf(path, sizeof(path), "%s/f%07d.bin", dir, i);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+	    unix_error(path);
+	close(fd);
+    }
+    printf("glob       entries=%d made in %.1f s\n", iters, (now_us() - t0) / 1e6);
+    snprintf(path, sizeof(path), "%s/changed", dir);
+
+    for (k = 0; k < (int)(sizeof(pats) / sizeof(pats[0])); k++) {
+	snprintf(line, sizeof(line), "true %s/%s", dir, pats[k]);
+	for (i = 0; i < GLOBFRESH; i++) {
+	    if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) < 0)
+		unix_error(path);
+	    close(fd);
+	    unlink(path);
+	    t0 = now_us();
+	    if (parseline(line, &cmd) != 0)
+		app_error("bad glob line");
+	    samples[i] = now_us() - t0;
+	}
+	for (n = 0; cmd.argv[n + 1] != NULL; n++)
+	    ;
+	snprintf(out, sizeof(out), "%s-fresh", pats[k]);
+	report(out, samples, GLOBFRESH);
+	for (i = 0; i < GLOBWARM; i++) {
+	    t0 = now_us();
+	    if (parseline(line, &cmd) != 0)
+		app_error("bad glob line");
+	    samples[i] = now_us() - t0;
+	}
+	snprintf(out, sizeof(out), "%s-cached", pats[k]);
+	report(out, samples, GLOBWARM);
+
+	/* bash, in the C locale so it sorts the same way */
+	snprintf(line, sizeof(line), "LC_ALL=C bash -c 'set -- %s/%s; n=$#; "
+		 "for ((i = 1; i < %d; i++)); do set -- %s/%s; done; echo $n'",
+		 dir, pats[k], GLOBBASH, dir, pats[k]);
+	t0 = now_us();
+	if ((fp = popen(line, "r")) == NULL || fscanf(fp, "%ld", &want) != 1)
+	    app_error("bash glob failed");
+	pclose(fp);
+	t = (now_us() - t0) / GLOBBASH;
+	printf("glob       %-14s matches=%ld bash=%.0f us/expansion\n", pats[k], n, t);
+	snprintf(out, sizeof(out), "%s-bash", pats[k]);
+	metric(out, t, "us");
+	if (n != want)
+	    app_error("glob and bash found different matches");
+    }
+
+    for (i = 0; i < iters; i++) {
+	snprintf(path, sizeof(path), "%s/f%07d.bin", dir, i);
+	unlink(path);
+    }
+    rmdir(dir);
+    free(cmd.buf);
+    free(cmd.argv);
+}
+
+void bench_usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s <shell>] [-n <iters>] [-c <cmd>] "
+	    "[-m <MB,...>] [-z <size>] [-o <file>] <bench>\n", prog);
+    fprintf(stderr, "Benchmarks: prompt jobtable joblist tokenize spawn pipeline parallel batch reap bgdone builtins server attrs deadlines signals fanout history glob\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "s:n:c:m:z:o:")) != EOF) {
+	switch (c) {
+	case 's':
+	    shell = optarg;
+	    break;
+	case 'n':
+	    iters = atoi(optarg);
+	    break;
+	case 'c':
+	    snprintf(cmd, MAXBUF, "%s\n", optarg);
+	    break;
+	case 'm':
+	    rss_sizes = optarg;
+	    break;
+	case 'z':
+	    stream_size = optarg;
+	    break;
+	case 'o':
+	    if ((results = fopen(optarg, "a")) == NULL)
+		unix_error(optarg);
+	    break;
+	default:
+	    bench_usage(argv[0]);
+	}
+    }
+    if (optind == argc - 1 && iters == 0)
+	iters = !strcmp(argv[optind], "reap") ? 10000 : !strcmp(argv[optind], "builtins") ? 20 :
+	    !strcmp(argv[optind], "history") || !strcmp(argv[optind], "glob") ? 1000000 :
+	    !strcmp(argv[optind], "deadlines") || !strcmp(argv[optind], "fanout") ? 2000 : 200;
+    if (optind != argc - 1 || iters < 1)
+	bench_usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+    setenv("TSH_HISTORY", "", 1);     /* keep the commands sent out of the user's history */
+    benchname = argv[optind];
+
+    if (!strcmp(argv[optind], "prompt"))
+	bench_prompt();
+    else if (!strcmp(argv[optind], "jobtable"))
+	bench_jobtable();
+    else if (!strcmp(argv[optind], "joblist"))
+	bench_joblist();
+    else if (!strcmp(argv[optind], "tokenize"))
+	bench_tokenize();
+    else if (!strcmp(argv[optind], "spawn"))
+	bench_spawn();
+    else if (!strcmp(argv[optind], "pipeline"))
+	bench_pipeline();
+    else if (!strcmp(argv[optind], "parallel"))
+	bench_parallel();
+    else if (!strcmp(argv[optind], "batch"))
+	bench_batch();
+    else if (!strcmp(argv[optind], "reap"))
+	bench_reap();
+    else if (!strcmp(argv[optind], "bgdone"))
+	bench_bgdone();
+    else if (!strcmp(argv[optind], "builtins"))
+	bench_builtins();
+    else if (!strcmp(argv[optind], "server"))
+	bench_server();
+    else if (!strcmp(argv[optind], "attrs"))
+	bench_attrs();
+    else if (!strcmp(argv[optind], "deadlines"))
+	bench_deadlines();
+    else if (!strcmp(argv[optind], "signals"))
+	bench_signals();
+    else if (!strcmp(argv[optind], "fanout"))
+	bench_fanout();
+    else if (!strcmp(argv[optind], "history"))
+	bench_history();
+    else if (!strcmp(argv[optind], "glob"))
+	bench_glob();
+    else
+	bench_usage(argv[0]);
+    exit(0);
+}